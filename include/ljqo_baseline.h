@@ -0,0 +1,66 @@
+/*
+ * ljqo_baseline.h
+ *
+ *   Join order baselines: join orders pinned in the table
+ *   ljqo.ljqo_baseline (see ljqo_baseline.sql) and replayed instead of running the optimizer.
+ *
+ *   A baseline is keyed by the shape of a join problem (relations and
+ *   edges, see ljqo_join_problem), so it still applies when the row
+ *   estimates change. Baselines are recorded and removed with the SQL
+ *   functions ljqo_baseline_capture(query) and ljqo_baseline_drop(query),
+ *   the only supported way to change the table.
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#ifndef LJQO_BASELINE_H_
+#define LJQO_BASELINE_H_
+
+#include "ljqo.h"
+#include "ljqo_cache.h"
+#include <fmgr.h>
+
+#define DEFAULT_LJQO_BASELINES  false
+
+/*
+ * Table of baselines. It is looked up in a fixed schema, not through
+ * search_path, so that a temporary or earlier table of the same name can
+ * not inject join orders.
+ */
+#define LJQO_BASELINE_SCHEMA  "ljqo"
+#define LJQO_BASELINE_TABLE   "ljqo_baseline"
+#define LJQO_BASELINE_QUALIFIED_TABLE \
+	LJQO_BASELINE_SCHEMA "." LJQO_BASELINE_TABLE
+
+extern bool ljqo_baselines;
+
+extern void ljqo_baseline_init(void);
+extern bool ljqo_baseline_active(void);
+extern RelOptInfo *ljqo_baseline_lookup(PlannerInfo *root,
+		ljqo_join_problem *problem);
+extern void ljqo_baseline_note(ljqo_join_problem *problem,
+		RelOptInfo *result);
+
+extern Datum ljqo_baseline_capture(PG_FUNCTION_ARGS);
+extern Datum ljqo_baseline_drop(PG_FUNCTION_ARGS);
+
+#endif /* LJQO_BASELINE_H_ */
@@ -0,0 +1,100 @@
+/*
+ * ljqo_cache.h
+ *
+ *   Per-backend cache of join orders.
+ *
+ *   A join problem (the relations given to the join search) is described
+ *   by the identities of its relations, the edges of its query graph and
+ *   the order of magnitude of the row estimate of each relation. When the
+ *   same problem is planned again, the join order found the first time is
+ *   replayed with make_join_rel() instead of running the optimizer.
+ *
+ *   Join orders are kept by each backend (ljqo_cache_size) and, when the
+ *   library is in shared_preload_libraries, in shared memory too
+ *   (ljqo_shared_cache_size), where they are reused by every backend.
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#ifndef LJQO_CACHE_H_
+#define LJQO_CACHE_H_
+
+#include "ljqo.h"
+#include <limits.h>
+#include <nodes/relation.h>
+
+#define DEFAULT_LJQO_CACHE_SIZE  0   /* entries, 0 = disabled */
+#define     MIN_LJQO_CACHE_SIZE  0
+#define     MAX_LJQO_CACHE_SIZE  (1 << 20)
+#define DEFAULT_LJQO_SHARED_CACHE_SIZE  0   /* entries, 0 = disabled */
+#define     MIN_LJQO_SHARED_CACHE_SIZE  0
+#define     MAX_LJQO_SHARED_CACHE_SIZE  (1 << 20)
+
+/* larger join problems are kept only by the per-backend cache */
+#define LJQO_SHARED_CACHE_MAX_RELS  128
+
+extern int ljqo_cache_size;
+extern int ljqo_shared_cache_size;
+
+/*
+ * ljqo_join_problem:
+ *    Description of a join problem. "words" is its canonical form, compared
+ *    on lookups; "fingerprint" is its hash. The first "nshape_words" words
+ *    describe the relations, the edges and the special joins, but not the
+ *    row estimates; "shape_fingerprint" is their hash.
+ */
+typedef struct ljqo_join_problem
+{
+	uint64       fingerprint;
+	uint64       shape_fingerprint;
+	uint32      *words;
+	int          nwords;
+	int          nshape_words;
+	RelOptInfo **rels;        /* initial rels, by position */
+	int          nrels;
+} ljqo_join_problem;
+
+/*
+ * A join order is a list of nrels-1 joins, steps[2*k] and steps[2*k+1].
+ * A value x >= 0 is the initial rel at position x; x < 0 is the join made
+ * by step -x-1.
+ */
+#define LJQO_JOIN_ORDER_STEPS(nrels)  ((nrels) - 1)
+
+extern ljqo_join_problem *ljqo_join_problem_create(PlannerInfo *root,
+		List *initial_rels, int nrels);
+extern void ljqo_join_problem_destroy(ljqo_join_problem *problem);
+extern bool ljqo_join_order_extract(ljqo_join_problem *problem,
+		RelOptInfo *result, int *steps);
+extern RelOptInfo *ljqo_join_order_replay(PlannerInfo *root,
+		ljqo_join_problem *problem, const int *steps);
+
+extern bool ljqo_cache_enabled(void);
+extern RelOptInfo *ljqo_cache_lookup(PlannerInfo *root,
+		ljqo_join_problem *problem);
+extern void ljqo_cache_store(ljqo_join_problem *problem, RelOptInfo *result);
+extern void ljqo_cache_reset(void);
+extern const char *ljqo_cache_stats(void);
+extern void ljqo_cache_shmem_request(void);
+extern void ljqo_cache_shmem_release(void);
+
+#endif /* LJQO_CACHE_H_ */
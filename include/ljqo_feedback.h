@@ -0,0 +1,58 @@
+/*
+ * ljqo_feedback.h
+ *
+ *   Planning effort tuned by execution feedback.
+ *
+ *   The planning time and the execution time of each statement are
+ *   recorded (planner and executor hooks) for the join problems it
+ *   contains. The time budget of the algorithms (ljqo_time_budget.h) is
+ *   then adjusted for each join problem, keyed by the fingerprint of the
+ *   problem (ljqo_cache.h), so that planning stays close to the
+ *   fraction ljqo_feedback_ratio of the execution time: cheap queries get
+ *   less search, and expensive ones more, as long as more search makes
+ *   them faster (hill climbing). The fingerprint includes the order of
+ *   magnitude of the row estimates, so the same statement with very
+ *   different estimates is tuned separately.
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#ifndef LJQO_FEEDBACK_H_
+#define LJQO_FEEDBACK_H_
+
+#include "ljqo.h"
+#include "ljqo_cache.h"
+
+#define DEFAULT_LJQO_FEEDBACK_RATIO  0.0   /* 0 = disabled */
+#define     MIN_LJQO_FEEDBACK_RATIO  0.0
+#define     MAX_LJQO_FEEDBACK_RATIO  1.0
+
+extern double ljqo_feedback_ratio;
+
+extern void ljqo_feedback_init(void);
+extern void ljqo_feedback_fini(void);
+extern bool ljqo_feedback_enabled(void);
+extern int ljqo_feedback_budget(ljqo_join_problem *problem);
+extern void ljqo_feedback_planned(ljqo_join_problem *problem,
+		int budget_ms, double plan_ms);
+
+#endif /* LJQO_FEEDBACK_H_ */
@@ -0,0 +1,85 @@
+/*
+ * ljqo_graph.h
+ *
+ *   Query graph shared by the LJQO optimizers.
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#ifndef LJQO_GRAPH_H_
+#define LJQO_GRAPH_H_
+
+#include "ljqo.h"
+#include <nodes/relation.h>
+
+/*
+ * ljqo_graph:
+ *    Query graph over an array of relations (rels[0..nrels-1]). There is an
+ *    edge between two relations when they have a relevant join clause or a
+ *    join order restriction (see ljqo_graph_create()).
+ *
+ *    Edges are stored as pairs (edges[2*k], edges[2*k+1]), with the first
+ *    index lower than the second, sorted. The neighbors of relation i are
+ *    adj[adj_start[i] .. adj_start[i+1]-1], in ascending order.
+ */
+typedef struct ljqo_graph
+{
+	int     nrels;
+	int     nedges;
+	int    *edges;
+	int    *adj_start;
+	int    *adj;
+} ljqo_graph;
+
+#define ljqo_graph_degree(graph, i) \
+	((graph)->adj_start[(i) + 1] - (graph)->adj_start[i])
+
+/*
+ * ljqo_graph_shape:
+ *    Shape of a query graph (see ljqo_graph_classify()).
+ */
+typedef enum ljqo_graph_shape
+{
+	LJQO_GRAPH_CHAIN,			/* a path */
+	LJQO_GRAPH_STAR,			/* one relation joined to all the others */
+	LJQO_GRAPH_TREE,			/* other acyclic graphs (e.g. snowflake) */
+	LJQO_GRAPH_CYCLE,			/* a single cycle */
+	LJQO_GRAPH_CLIQUE,			/* every pair of relations joined */
+	LJQO_GRAPH_CYCLIC,			/* other connected graphs with cycles */
+	LJQO_GRAPH_DISCONNECTED		/* more than one component */
+} ljqo_graph_shape;
+
+typedef struct ljqo_graph_stats
+{
+	ljqo_graph_shape shape;
+	int     components;		/* connected components */
+	int     cycles;			/* independent cycles: edges - nrels + components */
+	int     max_degree;
+} ljqo_graph_stats;
+
+extern ljqo_graph *ljqo_graph_create(PlannerInfo *root, RelOptInfo **rels,
+		int nrels);
+extern void ljqo_graph_destroy(ljqo_graph *graph);
+extern void ljqo_graph_classify(ljqo_graph *graph, ljqo_graph_stats *stats);
+extern const char *ljqo_graph_shape_name(ljqo_graph_shape shape);
+
+#endif /* LJQO_GRAPH_H_ */
@@ -0,0 +1,85 @@
+/*
+ * ljqo_paths.h
+ *
+ *   Reduced path retention for the joins built while an LJQO optimizer
+ *   searches for a join order.
+ *
+ *   The search only reads cheapest_total_path of the joins it builds, but
+ *   add_path() keeps every path that is not dominated, including sorted and
+ *   parameterized ones. Upper joins then consider all of them. When
+ *   ljqo_reduced_paths is set, the optimizers keep only the cheapest total
+ *   path of each join built during the search. The chosen plan is built
+ *   again afterwards with full path retention.
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#ifndef LJQO_PATHS_H_
+#define LJQO_PATHS_H_
+
+#include "ljqo.h"
+#include <nodes/relation.h>
+
+#define DEFAULT_LJQO_REDUCED_PATHS  false
+
+extern bool ljqo_reduced_paths;
+
+/*
+ * ljqo_reduce_paths:
+ *    Keeps only the cheapest total path of a join built during the search.
+ *    Must be called after set_cheapest(). The dropped paths are freed, as
+ *    add_path() does, only when "new_rel" tells that the join was created
+ *    by the last make_join_rel() call: paths of an older join may be used
+ *    by upper joins.
+ */
+static inline void
+ljqo_reduce_paths(RelOptInfo *rel, bool new_rel)
+{
+	Path	   *cheapest;
+	ListCell   *lc;
+
+	if (!ljqo_reduced_paths || rel == NULL)
+		return;
+
+	cheapest = rel->cheapest_total_path;
+	if (cheapest == NULL || list_length(rel->pathlist) <= 1)
+		return;
+
+	if (new_rel)
+	{
+		foreach(lc, rel->pathlist)
+		{
+			Path	   *path = (Path *) lfirst(lc);
+
+			if (path != cheapest && !IsA(path, IndexPath))
+				pfree(path);
+		}
+	}
+
+	list_free(rel->pathlist);
+	rel->pathlist = list_make1(cheapest);
+	rel->cheapest_startup_path = cheapest;
+	list_free(rel->cheapest_parameterized_paths);
+	rel->cheapest_parameterized_paths = list_make1(cheapest);
+}
+
+#endif /* LJQO_PATHS_H_ */
@@ -0,0 +1,138 @@
+/*
+ * ljqo_random.h
+ *
+ *   Private pseudo-random number generator used by the LJQO optimizers.
+ *
+ *   Each optimizer invocation owns its own generator state, so planning
+ *   does not share (nor disturb) the random() sequence of the backend.
+ *   When ljqo_seed is set, the generator is always started from the same
+ *   state and planning becomes reproducible.
+ *
+ *   Generator: xoshiro256** by D. Blackman and S. Vigna, seeded through
+ *   splitmix64.
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#ifndef LJQO_RANDOM_H_
+#define LJQO_RANDOM_H_
+
+#include "ljqo.h"
+#include <limits.h>
+
+#define DEFAULT_LJQO_SEED  0   /* 0 = seed taken from random() */
+#define     MIN_LJQO_SEED  0
+#define     MAX_LJQO_SEED  INT_MAX
+
+extern int ljqo_seed;
+
+typedef struct ljqo_random_state
+{
+	uint64 s[4];
+} ljqo_random_state;
+
+static inline uint64
+ljqo_random_rotl(uint64 x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64
+ljqo_random_next(ljqo_random_state *state)
+{
+	uint64 *s = state->s;
+	uint64 result = ljqo_random_rotl(s[1] * 5, 7) * 9;
+	uint64 t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = ljqo_random_rotl(s[3], 45);
+
+	return result;
+}
+
+/*
+ * ljqo_random_init:
+ *    Starts a generator for one optimizer invocation. The seed is ljqo_seed,
+ *    or a value taken from random() when ljqo_seed is not set.
+ */
+static inline void
+ljqo_random_init(ljqo_random_state *state)
+{
+	uint64 x;
+	int    i;
+
+	Assert(state);
+
+	if (ljqo_seed != DEFAULT_LJQO_SEED)
+		x = (uint64) ljqo_seed;
+	else
+		x = ((uint64) random() << 31) ^ (uint64) random();
+
+	for (i = 0; i < 4; i++) /* splitmix64 */
+	{
+		uint64 z = (x += UINT64CONST(0x9E3779B97F4A7C15));
+		z = (z ^ (z >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+		z = (z ^ (z >> 27)) * UINT64CONST(0x94D049BB133111EB);
+		state->s[i] = z ^ (z >> 31);
+	}
+}
+
+/*
+ * ljqo_random_int:
+ *    Uniform integer in [0, n). Uses the multiply-shift method with
+ *    rejection (D. Lemire), so it has neither the bias nor the division of
+ *    "random() % n".
+ */
+static inline int
+ljqo_random_int(ljqo_random_state *state, int n)
+{
+	uint32 range = (uint32) n;
+	uint64 m;
+
+	Assert(n > 0);
+
+	m = (ljqo_random_next(state) >> 32) * range;
+	if ((uint32) m < range)
+	{
+		uint32 threshold = (-range) % range;
+		while ((uint32) m < threshold)
+			m = (ljqo_random_next(state) >> 32) * range;
+	}
+
+	return (int) (m >> 32);
+}
+
+/*
+ * ljqo_random_double:
+ *    Uniform real number in [0, 1).
+ */
+static inline double
+ljqo_random_double(ljqo_random_state *state)
+{
+	return (ljqo_random_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif /* LJQO_RANDOM_H_ */
@@ -0,0 +1,176 @@
+/*
+ * ljqo_time_budget.h
+ *
+ *   Planning time budget of the LJQO optimizers.
+ *
+ *   ljqo_selector() starts the budget before calling an LJQO algorithm.
+ *   The algorithms check it in their main loops and, once it is exhausted,
+ *   finish with the best plan found so far.
+ *
+ *   Time is read from a monotonic clock where available, so a step of the
+ *   system clock neither ends a search at once nor lets it run unbounded.
+ *   Loops over cheap moves use ljqo_time_budget_poll(), which reads the
+ *   clock only every LJQO_TIME_BUDGET_POLL_MOVES calls.
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#ifndef LJQO_TIME_BUDGET_H_
+#define LJQO_TIME_BUDGET_H_
+
+#include "ljqo.h"
+#include <limits.h>
+#include <time.h>
+#include <portability/instr_time.h>
+
+#define DEFAULT_LJQO_TIME_BUDGET_MS  0   /* 0 = no limit */
+#define     MIN_LJQO_TIME_BUDGET_MS  0
+#define     MAX_LJQO_TIME_BUDGET_MS  INT_MAX
+
+/* calls of ljqo_time_budget_poll() per reading of the clock */
+#define LJQO_TIME_BUDGET_POLL_MOVES  32
+
+/*
+ * ljqo_time:
+ *    Point in time of the budget clock.
+ */
+#ifdef CLOCK_MONOTONIC
+typedef struct timespec ljqo_time;
+#define LJQO_TIME_SET_CURRENT(t)  clock_gettime(CLOCK_MONOTONIC, &(t))
+#define LJQO_TIME_GET_MILLISEC(t) \
+	((double) (t).tv_sec * 1000.0 + (double) (t).tv_nsec / 1000000.0)
+#else
+typedef instr_time ljqo_time;
+#define LJQO_TIME_SET_CURRENT(t)  INSTR_TIME_SET_CURRENT(t)
+#define LJQO_TIME_GET_MILLISEC(t) INSTR_TIME_GET_MILLISEC(t)
+#endif
+
+extern int ljqo_time_budget_ms;
+
+/* budget of the running optimization (0 = no limit) and its start time */
+extern int        ljqo_time_budget_current_ms;
+extern ljqo_time  ljqo_time_budget_start_time;
+
+/* state of ljqo_time_budget_poll() */
+extern int        ljqo_time_budget_polls;
+extern bool       ljqo_time_budget_expired;
+
+/*
+ * ljqo_time_budget_start_ms:
+ *    Starts the budget of a new optimization with "budget_ms" (0 = no
+ *    limit).
+ */
+static inline void
+ljqo_time_budget_start_ms(int budget_ms)
+{
+	ljqo_time_budget_current_ms = budget_ms;
+	ljqo_time_budget_polls = 0;
+	ljqo_time_budget_expired = false;
+	if (ljqo_time_budget_current_ms > 0)
+		LJQO_TIME_SET_CURRENT(ljqo_time_budget_start_time);
+}
+
+/*
+ * ljqo_time_budget_start:
+ *    Starts the budget of a new optimization with ljqo_time_budget_ms.
+ */
+static inline void
+ljqo_time_budget_start(void)
+{
+	ljqo_time_budget_start_ms(ljqo_time_budget_ms);
+}
+
+/*
+ * ljqo_time_budget_stop:
+ *    Disables the budget at the end of an optimization.
+ */
+static inline void
+ljqo_time_budget_stop(void)
+{
+	ljqo_time_budget_current_ms = 0;
+	ljqo_time_budget_expired = false;
+}
+
+/*
+ * ljqo_time_budget_now:
+ *    Current time of the budget clock.
+ */
+static inline ljqo_time
+ljqo_time_budget_now(void)
+{
+	ljqo_time now;
+
+	LJQO_TIME_SET_CURRENT(now);
+
+	return now;
+}
+
+/*
+ * ljqo_time_budget_elapsed_ms:
+ *    Milliseconds since "start".
+ */
+static inline double
+ljqo_time_budget_elapsed_ms(ljqo_time start)
+{
+	ljqo_time now = ljqo_time_budget_now();
+
+	return LJQO_TIME_GET_MILLISEC(now) - LJQO_TIME_GET_MILLISEC(start);
+}
+
+/*
+ * ljqo_time_budget_exhausted:
+ *    True if the running optimization has used up its budget. Reads the
+ *    clock; used between expensive steps.
+ */
+static inline bool
+ljqo_time_budget_exhausted(void)
+{
+	if (ljqo_time_budget_current_ms <= 0)
+		return false;
+
+	if (!ljqo_time_budget_expired &&
+		ljqo_time_budget_elapsed_ms(ljqo_time_budget_start_time)
+			>= (double) ljqo_time_budget_current_ms)
+		ljqo_time_budget_expired = true;
+
+	return ljqo_time_budget_expired;
+}
+
+/*
+ * ljqo_time_budget_poll:
+ *    Like ljqo_time_budget_exhausted(), but reads the clock only every
+ *    LJQO_TIME_BUDGET_POLL_MOVES calls. Used between cheap moves.
+ */
+static inline bool
+ljqo_time_budget_poll(void)
+{
+	if (ljqo_time_budget_current_ms <= 0)
+		return false;
+
+	if (++ljqo_time_budget_polls < LJQO_TIME_BUDGET_POLL_MOVES)
+		return ljqo_time_budget_expired;
+
+	ljqo_time_budget_polls = 0;
+	return ljqo_time_budget_exhausted();
+}
+
+#endif /* LJQO_TIME_BUDGET_H_ */
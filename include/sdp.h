@@ -62,6 +62,9 @@ extern int sdp_iteration_slope;
 extern int sdp_iteration_const;
 extern int sdp_min_iterations;
 extern int sdp_max_iterations;
+extern int sdp_dp_window;
+extern int sdp_top_sequences;
+extern int sdp_adaptive_stop;
 
 /*
  * Configuration options:
@@ -78,5 +81,14 @@ extern int sdp_max_iterations;
 #define DEFAULT_SDP_ITERATION_CONST   250
 #define     MIN_SDP_ITERATION_CONST   0
 #define     MAX_SDP_ITERATION_CONST   INT_MAX/2
+#define DEFAULT_SDP_DP_WINDOW         0   /* 0 = full DP-phase */
+#define     MIN_SDP_DP_WINDOW         0
+#define     MAX_SDP_DP_WINDOW         INT_MAX
+#define DEFAULT_SDP_TOP_SEQUENCES     1
+#define     MIN_SDP_TOP_SEQUENCES     1
+#define     MAX_SDP_TOP_SEQUENCES     1024
+#define DEFAULT_SDP_ADAPTIVE_STOP     0   /* 0 = fixed number of samples */
+#define     MIN_SDP_ADAPTIVE_STOP     0
+#define     MAX_SDP_ADAPTIVE_STOP     100
 
 #endif   /* SDP_H */
@@ -33,9 +33,11 @@
 #include <nodes/relation.h>
 #include <nodes/memnodes.h>
 
-#ifdef HAVE_MEMSTATS
+/*
+ * Plan cache. The size of the cache is tracked by TwoPO itself, so it does
+ * not depend on memory statistics from a patched PostgreSQL.
+ */
 #define TWOPO_CACHE_PLANS
-#endif
 
 #define DEFAULT_TWOPO_BUSHY_SPACE               true
 #define DEFAULT_TWOPO_HEURISTIC_STATES          true
@@ -43,6 +45,7 @@
 #define     MIN_TWOPO_II_STOP                   1
 #define     MAX_TWOPO_II_STOP                   INT_MAX
 #define DEFAULT_TWOPO_II_IMPROVE_STATES         true
+#define DEFAULT_TWOPO_II_CUTOFF                 false
 #define DEFAULT_TWOPO_SA_PHASE                  true
 #define DEFAULT_TWOPO_SA_INITIAL_TEMPERATURE    0.1
 #define     MIN_TWOPO_SA_INITIAL_TEMPERATURE    0.01
@@ -53,6 +56,16 @@
 #define DEFAULT_TWOPO_SA_EQUILIBRIUM            16
 #define     MIN_TWOPO_SA_EQUILIBRIUM            1
 #define     MAX_TWOPO_SA_EQUILIBRIUM            INT_MAX
+#define DEFAULT_TWOPO_STATE_MEMO_SIZE           8192
+#define     MIN_TWOPO_STATE_MEMO_SIZE           0
+#define     MAX_TWOPO_STATE_MEMO_SIZE           (1 << 24)
+#define DEFAULT_TWOPO_ROWS_ONLY                 false
+#define DEFAULT_TWOPO_FINALISTS                 5
+#define     MIN_TWOPO_FINALISTS                 1
+#define     MAX_TWOPO_FINALISTS                 1024
+#define DEFAULT_TWOPO_REFINE_SIZE               0
+#define     MIN_TWOPO_REFINE_SIZE               0
+#define     MAX_TWOPO_REFINE_SIZE               (1 << 20)
 #ifdef TWOPO_CACHE_PLANS
 #define DEFAULT_TWOPO_CACHE_PLANS               true
 #define DEFAULT_TWOPO_CACHE_SIZE                51200
@@ -64,13 +77,19 @@ extern bool   twopo_bushy_space;
 extern bool   twopo_heuristic_states;
 extern int    twopo_ii_stop;
 extern bool   twopo_ii_improve_states;
+extern bool   twopo_ii_cutoff;                 /* cost cutoff heuristic in II */
 extern bool   twopo_sa_phase;
 extern double twopo_sa_initial_temperature;    /* T = X * cost(S0) */
 extern double twopo_sa_temperature_reduction;  /* Tnew = X * Told */
 extern int    twopo_sa_equilibrium;            /* E * Joins */
+extern int    twopo_state_memo_size;           /* entries, 0 = disabled */
+extern bool   twopo_rows_only;                 /* estimate rows during search */
+extern int    twopo_finalists;                 /* states fully planned at end */
+extern int    twopo_refine_size;               /* problems whose search is
+                                                * continued, 0 = disabled */
 #ifdef TWOPO_CACHE_PLANS
 extern bool   twopo_cache_plans;
-extern int    twopo_cache_size;  /* limit the size of temporary mem ctx (KB) */
+extern int    twopo_cache_size;  /* approx. limit of the join cache (KB) */
 #endif
 
 extern RelOptInfo *twopo(PlannerInfo *root,
@@ -0,0 +1,43 @@
+--
+-- ljqo_baseline.sql
+--
+--   Join order baselines of the LJQO plugin. Run this script in each
+--   database that uses baselines. The table is always looked up in the
+--   schema ljqo, whatever the search_path. Adjust the path of the library
+--   if it is not installed in the dynamic_library_path.
+--
+--   Baselines are replayed only with ljqo_baselines = on.
+--
+--   The table must only be changed through the functions below: other
+--   backends reload their copy of the table on the invalidation sent by
+--   them, and would not see a plain INSERT, UPDATE or DELETE. DML on the
+--   table is therefore revoked.
+--
+--   Usage:
+--     SELECT ljqo.ljqo_baseline_capture('SELECT ... FROM ...');
+--     SELECT ljqo.ljqo_baseline_drop('SELECT ... FROM ...');
+--
+
+CREATE SCHEMA ljqo;
+
+CREATE TABLE ljqo.ljqo_baseline (
+	fingerprint  bigint      NOT NULL,
+	problem      integer[]   NOT NULL,
+	join_order   integer[]   NOT NULL,
+	query        text,
+	captured_at  timestamptz NOT NULL DEFAULT now(),
+	PRIMARY KEY (fingerprint, problem)
+);
+
+REVOKE ALL ON ljqo.ljqo_baseline FROM PUBLIC;
+GRANT SELECT ON ljqo.ljqo_baseline TO PUBLIC;
+
+CREATE FUNCTION ljqo.ljqo_baseline_capture(query text)
+	RETURNS integer
+	AS 'libljqo', 'ljqo_baseline_capture'
+	LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ljqo.ljqo_baseline_drop(query text)
+	RETURNS integer
+	AS 'libljqo', 'ljqo_baseline_drop'
+	LANGUAGE C STRICT VOLATILE;
@@ -32,6 +32,7 @@
 #include <optimizer/geqo.h>
 #include <utils/guc.h>
 #include <lib/stringinfo.h>
+#include <utils/builtins.h>
 #include <limits.h>
 
 #include "opte.h"
@@ -39,6 +40,13 @@
 #include "debuggraph_node.h"
 #include "sdp.h"
 #include "twopo.h"
+#include "ljqo_random.h"
+#include "ljqo_time_budget.h"
+#include "ljqo_paths.h"
+#include "ljqo_graph.h"
+#include "ljqo_cache.h"
+#include "ljqo_baseline.h"
+#include "ljqo_feedback.h"
 
 /*
  * ========================================================================
@@ -56,6 +64,20 @@
 #	define DEFAULT_LJQO_ALGORITHM_STR  "geqo"
 #endif
 
+/* "auto": chains and cycles up to this size use standard DP */
+#define LJQO_AUTO_DP_MAX_RELS           32
+
+/* "portfolio": algorithms run for each query */
+#if defined(REGISTER_SDP) && defined(REGISTER_TWOPO)
+#	define DEFAULT_LJQO_PORTFOLIO_STR  "sdp,twopo"
+#elif defined(REGISTER_SDP)
+#	define DEFAULT_LJQO_PORTFOLIO_STR  "sdp,geqo"
+#elif defined(REGISTER_TWOPO)
+#	define DEFAULT_LJQO_PORTFOLIO_STR  "twopo,geqo"
+#else
+#	define DEFAULT_LJQO_PORTFOLIO_STR  "geqo"
+#endif
+
 /*
  * ========================================================================
  * ====================== Control Structures ==============================
@@ -77,6 +99,36 @@ static int                     ljqo_threshold = DEFAULT_LJQO_THRESHOLD;
 static join_search_hook_type   ljqo_algorithm = DEFAULT_LJQO_ALGORITHM;
 static char                   *ljqo_algorithm_str = DEFAULT_LJQO_ALGORITHM_STR;
 static char                   *ljqo_about_str = "";
+static char                   *ljqo_portfolio_str = DEFAULT_LJQO_PORTFOLIO_STR;
+static char                   *ljqo_cache_stats_str = "";
+
+/* seed of the private PRNG of the algorithms (ljqo_random.h) */
+int                            ljqo_seed = DEFAULT_LJQO_SEED;
+
+/* planning time limit of the algorithms (ljqo_time_budget.h) */
+int                            ljqo_time_budget_ms = DEFAULT_LJQO_TIME_BUDGET_MS;
+int                            ljqo_time_budget_current_ms = 0;
+ljqo_time                      ljqo_time_budget_start_time;
+int                            ljqo_time_budget_polls = 0;
+bool                           ljqo_time_budget_expired = false;
+
+/* keep only the cheapest path of the joins built by a search (ljqo_paths.h) */
+bool                           ljqo_reduced_paths = DEFAULT_LJQO_REDUCED_PATHS;
+
+/* entries of the join order cache (ljqo_cache.h) */
+int                            ljqo_cache_size = DEFAULT_LJQO_CACHE_SIZE;
+int                            ljqo_shared_cache_size = DEFAULT_LJQO_SHARED_CACHE_SIZE;
+
+/* replay the join orders of the table ljqo_baseline (ljqo_baseline.h) */
+bool                           ljqo_baselines = DEFAULT_LJQO_BASELINES;
+
+/* share of execution time given to planning (ljqo_feedback.h) */
+double                         ljqo_feedback_ratio = DEFAULT_LJQO_FEEDBACK_RATIO;
+
+static RelOptInfo *ljqo_auto(PlannerInfo *root, int levels_needed,
+		List *initial_rels);
+static RelOptInfo *ljqo_portfolio(PlannerInfo *root, int levels_needed,
+		List *initial_rels);
 
 /*
  * List of registred algorithms
@@ -84,6 +136,10 @@ static char                   *ljqo_about_str = "";
 static ljqo_optimizer optimizers[] =
 {
 	{"geqo","Genetic Query Optimization (compatibility only)",geqo,NULL,NULL},
+	{"auto","Algorithm chosen by the shape of the query graph",ljqo_auto,
+		NULL,NULL},
+	{"portfolio","Cheapest plan of the algorithms in ljqo_portfolio",
+		ljqo_portfolio,NULL,NULL},
 #	ifdef REGISTER_SDP
 	REGISTER_SDP,
 #	endif
@@ -128,10 +184,58 @@ ljqo_selector(PlannerInfo *root, int levels_needed, List *initial_rels)
 	}
 	else if ( ljqo_algorithm != NULL ) /* num of baserels above the threshold */
 	{
-		/* call algorithm registered in ljqo_algorithm */
-		OPTE_PRINT_OPTNAME( ljqo_algorithm_str );
-		result = ljqo_algorithm(root, levels_needed, initial_rels );
-
+		ljqo_join_problem *problem = NULL;
+
+		if( ljqo_cache_enabled() || ljqo_baseline_active() ||
+				ljqo_feedback_enabled() )
+			problem = ljqo_join_problem_create(root, initial_rels,
+					levels_needed);
+
+		/* join order pinned by the DBA, then planned before */
+		result = NULL;
+		if( problem != NULL )
+		{
+			result = ljqo_baseline_lookup(root, problem);
+			if( result != NULL )
+			{
+				OPTE_PRINT_OPTNAME( "baseline" );
+			}
+			else if( ljqo_cache_enabled() )
+			{
+				result = ljqo_cache_lookup(root, problem);
+				if( result != NULL )
+					OPTE_PRINT_OPTNAME( "cache" );
+			}
+		}
+
+		if( result == NULL )
+		{
+			int			budget = ljqo_time_budget_ms;
+			ljqo_time	start;
+
+			/* planning effort tuned by the executions of the problem */
+			if( problem != NULL && ljqo_feedback_enabled() )
+				budget = ljqo_feedback_budget(problem);
+
+			/* call algorithm registered in ljqo_algorithm */
+			OPTE_PRINT_OPTNAME( ljqo_algorithm_str );
+			start = ljqo_time_budget_now();
+			ljqo_time_budget_start_ms(budget);
+			result = ljqo_algorithm(root, levels_needed, initial_rels );
+			ljqo_time_budget_stop();
+
+			if( problem != NULL && ljqo_feedback_enabled() )
+				ljqo_feedback_planned(problem, budget,
+						ljqo_time_budget_elapsed_ms(start));
+
+			if( problem != NULL && ljqo_cache_enabled() )
+				ljqo_cache_store(problem, result);
+		}
+
+		if( problem != NULL )
+			ljqo_baseline_note(problem, result);
+
+		ljqo_join_problem_destroy(problem);
 	}
 	else /* exception error */
 		elog(ERROR, PACKAGE_NAME" was loaded but there isn't any defined "
@@ -147,6 +251,238 @@ ljqo_selector(PlannerInfo *root, int levels_needed, List *initial_rels)
 	return result;
 }
 
+/*
+ * ljqo_auto:
+ *    Algorithm "auto". Classifies the query graph and calls the algorithm
+ *    that suits its shape:
+ *     - chains and cycles are solved exactly by the standard dynamic
+ *       programming up to LJQO_AUTO_DP_MAX_RELS relations: it only joins
+ *       connected subgraphs, which are O(n^2) on these shapes;
+ *     - acyclic graphs (larger chains, stars, snowflakes) go to SDP, whose
+ *       samples follow the edges of the graph;
+ *     - disconnected graphs go to SDP too: it plans each component and
+ *       joins them, while TwoPO only adds cross products for isolated
+ *       relations and cannot encode a forest of two or more joined
+ *       components (e.g. "FROM a, b, c, d WHERE a.x = b.x AND c.y = d.y"
+ *       with ljqo_threshold = 4);
+ *     - connected graphs with cycles go to TwoPO, which moves freely in
+ *       the bushy space.
+ *    When SDP or TwoPO is not built in, the other one (or GEQO) is used.
+ *    Each algorithm runs with its own settings.
+ */
+static RelOptInfo *
+ljqo_auto(PlannerInfo *root, int levels_needed, List *initial_rels)
+{
+	RelOptInfo	  **rels;
+	ljqo_graph	   *graph;
+	ljqo_graph_stats stats;
+	ListCell	   *lc;
+	int				i = 0;
+	const char	   *name;
+	join_search_hook_type search_f = geqo;
+
+	rels = (RelOptInfo **) palloc(sizeof(RelOptInfo *) * levels_needed);
+	foreach(lc, initial_rels)
+		rels[i++] = (RelOptInfo *) lfirst(lc);
+
+	graph = ljqo_graph_create(root, rels, levels_needed);
+	ljqo_graph_classify(graph, &stats);
+	ljqo_graph_destroy(graph);
+	pfree(rels);
+
+	if ((stats.shape == LJQO_GRAPH_CHAIN || stats.shape == LJQO_GRAPH_CYCLE)
+		&& levels_needed <= LJQO_AUTO_DP_MAX_RELS)
+	{
+		name = "standard";
+		search_f = standard_join_search;
+	}
+	else if (stats.components > 1 || stats.cycles == 0)
+	{
+#	if defined(REGISTER_SDP)
+		name = "sdp";
+		search_f = sdp;
+#	elif defined(REGISTER_TWOPO)
+		name = "twopo";
+		search_f = twopo;
+#	else
+		name = "geqo";
+#	endif
+	}
+	else
+	{
+#	if defined(REGISTER_TWOPO)
+		name = "twopo";
+		search_f = twopo;
+#	elif defined(REGISTER_SDP)
+		name = "sdp";
+		search_f = sdp;
+#	else
+		name = "geqo";
+#	endif
+	}
+
+	opte_printf("Auto: shape=%s, components=%d, cycles=%d, "
+			"max_degree=%d, algorithm=%s",
+			ljqo_graph_shape_name(stats.shape), stats.components,
+			stats.cycles, stats.max_degree, name);
+	elog(DEBUG1, "ljqo auto: %d relations, %s graph, using %s",
+		 levels_needed, ljqo_graph_shape_name(stats.shape), name);
+
+	return search_f(root, levels_needed, initial_rels);
+}
+
+/*
+ * find_optimizer:
+ *    Registered algorithm called "name", or NULL.
+ */
+static ljqo_optimizer *
+find_optimizer(const char *name)
+{
+	ljqo_optimizer *opt = optimizers;
+
+	while( opt->name != NULL )
+	{
+		if( strcmp(opt->name, name) == 0 )
+			return opt;
+
+		opt++;
+	}
+
+	return NULL;
+}
+
+/*
+ * ljqo_portfolio:
+ *    Algorithm "portfolio". Runs each algorithm of ljqo_portfolio in turn
+ *    and returns the cheapest plan. An algorithm that returns no plan
+ *    covering every relation is skipped.
+ *
+ *    The planning budget (ljqo_time_budget_ms) is shared: each algorithm
+ *    gets an equal part of what is left when it starts, so time not used
+ *    by one algorithm goes to the next ones. Without a budget every
+ *    algorithm runs to completion. The first algorithm always runs.
+ *
+ *    Each run starts from the same root->join_rel_list, as in GEQO, so the
+ *    join rels of one algorithm are never modified by another one. At the
+ *    end, the list keeps the join rels of the winner.
+ */
+static RelOptInfo *
+ljqo_portfolio(PlannerInfo *root, int levels_needed, List *initial_rels)
+{
+	char	   *rawstring = pstrdup(ljqo_portfolio_str);
+	List	   *names;
+	ListCell   *lc;
+	int			savelength = list_length(root->join_rel_list);
+	RelOptInfo *best = NULL;
+	List	   *best_join_rels = NIL;
+	int			budget = ljqo_time_budget_current_ms;
+	ljqo_time	start = ljqo_time_budget_start_time;
+	int			left = 0;
+	Relids		relids = NULL;
+
+	foreach(lc, initial_rels)
+		relids = bms_add_members(relids, ((RelOptInfo *) lfirst(lc))->relids);
+
+	/* already validated by check_ljqo_portfolio() */
+	if( !SplitIdentifierString(rawstring, ',', &names) || names == NIL )
+		elog(ERROR, "invalid list syntax in ljqo_portfolio");
+
+	left = list_length(names);
+	foreach(lc, names)
+	{
+		ljqo_optimizer *opt = find_optimizer((char *) lfirst(lc));
+		RelOptInfo	   *rel;
+
+		Assert(opt != NULL);
+
+		if( budget > 0 )
+		{
+			double remaining = budget - ljqo_time_budget_elapsed_ms(start);
+
+			if( best != NULL && remaining < 1 )
+				break;
+			ljqo_time_budget_start_ms(Max((int) (remaining / left), 1));
+		}
+		left--;
+
+		root->join_rel_hash = NULL;
+		rel = opt->search_f(root, levels_needed, initial_rels);
+
+		/* skip an algorithm that could not join all the relations */
+		if( rel == NULL || rel->cheapest_total_path == NULL ||
+			!bms_equal(rel->relids, relids) )
+		{
+			elog(DEBUG1, "ljqo portfolio: %s found no complete plan",
+				 opt->name);
+			root->join_rel_list = list_truncate(root->join_rel_list,
+												savelength);
+			continue;
+		}
+
+		opte_printf("Portfolio: %s cost=%.2lf", opt->name,
+				rel->cheapest_total_path->total_cost);
+
+		if( best == NULL || rel->cheapest_total_path->total_cost
+				< best->cheapest_total_path->total_cost )
+		{
+			best = rel;
+			list_free(best_join_rels);
+			best_join_rels = list_copy_tail(root->join_rel_list, savelength);
+		}
+
+		root->join_rel_list = list_truncate(root->join_rel_list, savelength);
+	}
+
+	ljqo_time_budget_current_ms = budget;
+	ljqo_time_budget_start_time = start;
+	ljqo_time_budget_polls = 0;
+	ljqo_time_budget_expired = false;
+
+	if( best == NULL )
+		elog(ERROR, "ljqo portfolio: no algorithm found a complete plan");
+
+	/* the hash is rebuilt by find_join_rel() when needed */
+	root->join_rel_list = list_concat(root->join_rel_list, best_join_rels);
+	root->join_rel_hash = NULL;
+
+	list_free(names);
+	pfree(rawstring);
+	bms_free(relids);
+
+	return best;
+}
+
+/*
+ * check_ljqo_portfolio:
+ *    Validates ljqo_portfolio: a list of registered algorithms, other than
+ *    "portfolio" itself.
+ *    This function is used by ljqo_portfolio GUC parameter.
+ */
+static bool
+check_ljqo_portfolio(char **newval, void **extra, GucSource source)
+{
+	char	   *rawstring = pstrdup(*newval);
+	List	   *names;
+	ListCell   *lc;
+	bool		result = true;
+
+	if( !SplitIdentifierString(rawstring, ',', &names) || names == NIL )
+		result = false;
+
+	foreach(lc, names)
+	{
+		const char *name = (const char *) lfirst(lc);
+
+		if( find_optimizer(name) == NULL || strcmp(name, "portfolio") == 0 )
+			result = false;
+	}
+
+	list_free(names);
+	pfree(rawstring);
+
+	return result;
+}
+
 /*
  * check_ljqo_algorithm:
  *    Validates ljqo_algorithm informed by the user.
@@ -185,6 +521,20 @@ assign_ljqo_algorithm(const char *newval, void *extra)
 
 		opt++;
 	}
+
+	/* cached join orders were found by the previous algorithm */
+	ljqo_cache_reset();
+}
+
+/*
+ * assign_ljqo_cache_size:
+ *    A new size empties the join order cache.
+ *    This function is used by ljqo_cache_size GUC parameter.
+ */
+static void
+assign_ljqo_cache_size(int newval, void *extra)
+{
+	ljqo_cache_reset();
 }
 
 /*
@@ -204,7 +554,44 @@ show_ljqo_about(void)
 		"  ljqo_threshold = N;    - Call an LJQO algorithm when the number\n"
 		"                           of relations is greater than or equal to\n"
 		"                           N.\n"
-		"  ljqo_algorithm = name; - Algorithm to be called.\n\n"
+		"  ljqo_algorithm = name; - Algorithm to be called.\n"
+		"  ljqo_cache_size = N;   - Number of join orders remembered by each\n"
+		"                           backend. A query whose join problem was\n"
+		"                           planned before reuses its join order\n"
+		"                           without running the algorithm. 0\n"
+		"                           (default) disables the cache. See\n"
+		"                           'show ljqo_cache_stats;'.\n"
+		"  ljqo_shared_cache_size = N; - Number of join orders shared by\n"
+		"                           all backends. Needs the library in\n"
+		"                           shared_preload_libraries and a\n"
+		"                           restart. 0 (default) disables it.\n"
+		"  ljqo_baselines = bool; - Replay the join orders pinned in the\n"
+		"                           table ljqo.ljqo_baseline (see\n"
+		"                           ljqo_baseline.sql) instead of calling\n"
+		"                           the algorithm. Default is off.\n"
+		"  ljqo_feedback_ratio = R; - Tune the time budget of each join\n"
+		"                           problem from the executions of its\n"
+		"                           statements, so that planning takes\n"
+		"                           about the fraction R of execution\n"
+		"                           time. It starts from\n"
+		"                           ljqo_time_budget_ms. 0 (default)\n"
+		"                           disables it.\n"
+		"  ljqo_portfolio = 'name,...'; - Algorithms run by the\n"
+		"                           \"portfolio\" algorithm, which keeps\n"
+		"                           the cheapest plan. They share\n"
+		"                           ljqo_time_budget_ms.\n"
+		"  ljqo_seed = N;         - Seed of the random number generator used\n"
+		"                           by the algorithms. With N > 0 the plans\n"
+		"                           are reproducible. 0 (default) picks a new\n"
+		"                           seed for each query.\n"
+		"  ljqo_time_budget_ms = N; - Planning time limit of the algorithms\n"
+		"                           in milliseconds. When it is reached, the\n"
+		"                           best plan found so far is used. 0\n"
+		"                           (default) means no limit.\n"
+		"  ljqo_reduced_paths = {true|false}; - Keep only the cheapest\n"
+		"                           path of the joins built during the\n"
+		"                           search. The chosen plan is built again\n"
+		"                           with all paths. Default is false.\n\n"
 		"List of available algorithms:\n";
 
 	initStringInfo(&result);
@@ -269,6 +656,123 @@ _PG_init(void)
 							assign_ljqo_algorithm,
 							NULL);
 
+	DefineCustomIntVariable("ljqo_cache_size",
+							"LJQO Join Order Cache Size",
+							"Number of join orders cached by each backend "
+							"(0 = disabled).",
+							&ljqo_cache_size,
+							DEFAULT_LJQO_CACHE_SIZE,
+							MIN_LJQO_CACHE_SIZE,
+							MAX_LJQO_CACHE_SIZE,
+							PGC_USERSET,
+							0,
+							NULL,
+							assign_ljqo_cache_size,
+							NULL);
+
+	DefineCustomIntVariable("ljqo_shared_cache_size",
+							"LJQO Shared Join Order Cache Size",
+							"Number of join orders cached in shared memory "
+							"(0 = disabled).",
+							&ljqo_shared_cache_size,
+							DEFAULT_LJQO_SHARED_CACHE_SIZE,
+							MIN_LJQO_SHARED_CACHE_SIZE,
+							MAX_LJQO_SHARED_CACHE_SIZE,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("ljqo_cache_stats",
+							"LJQO Join Order Cache Statistics",
+							"Entries, hits and misses of the join order cache.",
+							&ljqo_cache_stats_str, /* only to prevent seg. fault */
+							"",
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							ljqo_cache_stats);
+
+	DefineCustomBoolVariable("ljqo_baselines",
+							"LJQO Baselines",
+							"Replay the join orders pinned in the table "
+							LJQO_BASELINE_QUALIFIED_TABLE ".",
+							&ljqo_baselines,
+							DEFAULT_LJQO_BASELINES,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("ljqo_feedback_ratio",
+							"LJQO Feedback Ratio",
+							"Fraction of execution time given to planning by "
+							"the budgets tuned from execution feedback "
+							"(0 = disabled).",
+							&ljqo_feedback_ratio,
+							DEFAULT_LJQO_FEEDBACK_RATIO,
+							MIN_LJQO_FEEDBACK_RATIO,
+							MAX_LJQO_FEEDBACK_RATIO,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("ljqo_portfolio",
+							"LJQO Portfolio",
+							"Algorithms run by the portfolio algorithm.",
+							&ljqo_portfolio_str,
+							DEFAULT_LJQO_PORTFOLIO_STR,
+							PGC_USERSET,
+							0,
+							check_ljqo_portfolio,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("ljqo_seed",
+							"LJQO Seed",
+							"Seed used by the randomized algorithms "
+							"(0 = new seed for each query).",
+							&ljqo_seed,
+							DEFAULT_LJQO_SEED,
+							MIN_LJQO_SEED,
+							MAX_LJQO_SEED,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("ljqo_time_budget_ms",
+							"LJQO Time Budget",
+							"Planning time limit of the algorithms "
+							"(0 = no limit).",
+							&ljqo_time_budget_ms,
+							DEFAULT_LJQO_TIME_BUDGET_MS,
+							MIN_LJQO_TIME_BUDGET_MS,
+							MAX_LJQO_TIME_BUDGET_MS,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("ljqo_reduced_paths",
+							"LJQO Reduced Paths",
+							"Keep only the cheapest total path of the joins "
+							"built during the search.",
+							&ljqo_reduced_paths,
+							DEFAULT_LJQO_REDUCED_PATHS,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 	/*
 	 * Call register function of each algorithm.
 	 */
@@ -282,6 +786,10 @@ _PG_init(void)
 
 	OPTE_REGISTER;
 
+	ljqo_cache_shmem_request();
+	ljqo_baseline_init();
+	ljqo_feedback_init();
+
 	join_search_hook = ljqo_selector;
 }
 
@@ -294,6 +802,8 @@ _PG_fini(void)
 	ljqo_optimizer *opt = optimizers;
 
 	join_search_hook = NULL;
+	ljqo_cache_shmem_release();
+	ljqo_feedback_fini();
 
 	while( opt->name != NULL )
 	{
@@ -0,0 +1,559 @@
+/*
+ * ljqo_baseline.c
+ *
+ *   Join order baselines (see ljqo_baseline.h).
+ *
+ *   Each backend keeps a copy of the table ljqo.ljqo_baseline in a hash
+ *   table indexed by shape fingerprint. The copy is loaded on first use
+ *   and read again when the table is invalidated: ljqo_baseline_capture()
+ *   and ljqo_baseline_drop() send a relcache invalidation, so the other
+ *   backends see their changes after commit. The table must only be
+ *   changed through these functions: rows changed by plain DML are only
+ *   seen after some other invalidation of the table, so ljqo_baseline.sql
+ *   revokes DML on it.
+ *
+ *   To capture or drop a baseline, the query is planned with the join
+ *   problems being recorded (see ljqo_baseline_note()).
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#include "ljqo_baseline.h"
+
+#include <access/heapam.h>
+#if PG_VERSION_NUM >= 90300
+#include <access/htup_details.h>
+#endif
+#include <catalog/namespace.h>
+#include <catalog/pg_type.h>
+#include <executor/spi.h>
+#include <tcop/tcopprot.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/hsearch.h>
+#include <utils/inval.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+#include <utils/tqual.h>
+
+/* columns of the table (see ljqo_baseline.sql) */
+#define Anum_baseline_fingerprint  1
+#define Anum_baseline_problem      2
+#define Anum_baseline_join_order   3
+#define Natts_baseline             3
+
+/*
+ * baseline:
+ *    A baseline loaded from the table.
+ */
+typedef struct baseline
+{
+	uint32     *words;        /* shape of the problem */
+	int         nwords;
+	int        *steps;        /* join order, see ljqo_cache.h */
+	int         nsteps;
+	struct baseline *next;    /* other baseline with the same fingerprint */
+} baseline;
+
+/*
+ * baseline_entry:
+ *    Baselines of a fingerprint. The key of the table is (fingerprint,
+ *    problem), so different problems with the same fingerprint are kept
+ *    apart.
+ */
+typedef struct baseline_entry
+{
+	uint64      fingerprint;  /* hash key, must be first */
+	baseline   *list;
+} baseline_entry;
+
+/*
+ * baseline_capture:
+ *    A join problem met while capturing or dropping baselines.
+ */
+typedef struct baseline_capture
+{
+	uint64      fingerprint;
+	ArrayType  *problem;
+	ArrayType  *join_order;   /* NULL if it can not be extracted */
+} baseline_capture;
+
+static MemoryContext baseline_context = NULL;
+static HTAB         *baselines = NULL;
+static Oid           baselines_relid = InvalidOid;
+static bool          baselines_valid = false;
+
+/* join problems recorded by collect_join_problems() */
+static bool          capturing = false;
+static MemoryContext capture_context = NULL;
+static List         *captures = NIL;
+
+/*
+ * int4_array:
+ *    One-dimensional int4[] with the "n" values of "values".
+ */
+static ArrayType *
+int4_array(const int32 *values, int n)
+{
+	Datum      *elems = (Datum *) palloc(sizeof(Datum) * Max(n, 1));
+	ArrayType  *result;
+	int         i;
+
+	for (i = 0; i < n; i++)
+		elems[i] = Int32GetDatum(values[i]);
+	result = construct_array(elems, n, INT4OID, sizeof(int32), true, 'i');
+	pfree(elems);
+
+	return result;
+}
+
+/*
+ * array_int4_values:
+ *    Values of an int4[] without NULLs, or NULL.
+ */
+static int32 *
+array_int4_values(Datum array, int *n)
+{
+	ArrayType  *arr = DatumGetArrayTypeP(array);
+	Datum      *elems;
+	bool       *nulls;
+	int32      *result;
+	int         i;
+
+	if (ARR_ELEMTYPE(arr) != INT4OID)
+		return NULL;
+
+	deconstruct_array(arr, INT4OID, sizeof(int32), true, 'i',
+					  &elems, &nulls, n);
+	result = (int32 *) palloc(sizeof(int32) * Max(*n, 1));
+	for (i = 0; i < *n; i++)
+	{
+		if (nulls[i])
+		{
+			pfree(result);
+			return NULL;
+		}
+		result[i] = DatumGetInt32(elems[i]);
+	}
+
+	return result;
+}
+
+/*
+ * baseline_relcache_callback:
+ *    The table was changed: baselines are loaded again on next use.
+ */
+static void
+baseline_relcache_callback(Datum arg, Oid relid)
+{
+	if (relid == InvalidOid || relid == baselines_relid)
+		baselines_valid = false;
+}
+
+/*
+ * baseline_relid:
+ *    Oid of the table of baselines in its schema, or InvalidOid.
+ */
+static Oid
+baseline_relid(void)
+{
+	Oid         nspid = get_namespace_oid(LJQO_BASELINE_SCHEMA, true);
+
+	if (!OidIsValid(nspid))
+		return InvalidOid;
+
+	return get_relname_relid(LJQO_BASELINE_TABLE, nspid);
+}
+
+/*
+ * load_baselines:
+ *    Makes the copy of the table current. Returns false if there is no
+ *    table.
+ */
+static bool
+load_baselines(void)
+{
+	Oid          relid = baseline_relid();
+	Relation     rel;
+	TupleDesc    desc;
+	HeapScanDesc scan;
+	HeapTuple    tuple;
+	HASHCTL      hash_ctl;
+
+	if (!OidIsValid(relid))
+		return false;
+
+	if (baselines_valid && relid == baselines_relid)
+		return true;
+
+	if (baseline_context)
+		MemoryContextDelete(baseline_context);
+	baseline_context = AllocSetContextCreate(TopMemoryContext,
+											 "LJQO Baselines",
+											 ALLOCSET_SMALL_MINSIZE,
+											 ALLOCSET_SMALL_INITSIZE,
+											 ALLOCSET_DEFAULT_MAXSIZE);
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(uint64);
+	hash_ctl.entrysize = sizeof(baseline_entry);
+	hash_ctl.hash = tag_hash;
+	hash_ctl.hcxt = baseline_context;
+	baselines = hash_create("LJQO baselines", 64, &hash_ctl,
+							HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	baselines_relid = relid;
+
+	rel = heap_open(relid, AccessShareLock);
+	desc = RelationGetDescr(rel);
+
+	if (desc->natts < Natts_baseline ||
+		desc->attrs[Anum_baseline_fingerprint - 1]->atttypid != INT8OID ||
+		desc->attrs[Anum_baseline_problem - 1]->atttypid != INT4ARRAYOID ||
+		desc->attrs[Anum_baseline_join_order - 1]->atttypid != INT4ARRAYOID)
+	{
+		heap_close(rel, AccessShareLock);
+		baselines_valid = true;  /* warn only once */
+		elog(WARNING, "table \"%s\" is not a table of join order baselines",
+			 LJQO_BASELINE_QUALIFIED_TABLE);
+		return false;
+	}
+
+	scan = heap_beginscan(rel, SnapshotNow, 0, NULL);
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		Datum       values[Natts_baseline];
+		bool        isnull[Natts_baseline];
+		int32      *words;
+		int32      *steps;
+		int         nwords;
+		int         nsteps;
+		uint64      fingerprint;
+		baseline_entry *entry;
+		baseline   *item;
+		bool        found;
+		int         i;
+
+		for (i = 0; i < Natts_baseline; i++)
+			values[i] = heap_getattr(tuple, i + 1, desc, &isnull[i]);
+		if (isnull[0] || isnull[1] || isnull[2])
+			continue;
+
+		words = array_int4_values(values[Anum_baseline_problem - 1], &nwords);
+		steps = array_int4_values(values[Anum_baseline_join_order - 1],
+								  &nsteps);
+		if (words == NULL || steps == NULL || nsteps % 2 != 0)
+			continue;
+
+		fingerprint = (uint64) DatumGetInt64(values[0]);
+		entry = (baseline_entry *) hash_search(baselines, &fingerprint,
+											   HASH_ENTER, &found);
+		if (!found)
+			entry->list = NULL;
+
+		item = (baseline *) MemoryContextAlloc(baseline_context,
+											   sizeof(baseline));
+		item->nwords = nwords;
+		item->words = (uint32 *) MemoryContextAlloc(baseline_context,
+				sizeof(uint32) * Max(nwords, 1));
+		for (i = 0; i < nwords; i++)
+			item->words[i] = (uint32) words[i];
+		item->nsteps = nsteps / 2;
+		item->steps = (int *) MemoryContextAlloc(baseline_context,
+				sizeof(int) * Max(nsteps, 1));
+		for (i = 0; i < nsteps; i++)
+			item->steps[i] = steps[i];
+		item->next = entry->list;
+		entry->list = item;
+
+		pfree(words);
+		pfree(steps);
+	}
+	heap_endscan(scan);
+	heap_close(rel, AccessShareLock);
+	baselines_valid = true;
+
+	return true;
+}
+
+/*
+ * ljqo_baseline_init:
+ *    Called by _PG_init().
+ */
+void
+ljqo_baseline_init(void)
+{
+	CacheRegisterRelcacheCallback(baseline_relcache_callback, (Datum) 0);
+}
+
+/*
+ * ljqo_baseline_active:
+ *    True if ljqo_selector() must describe its join problems for this
+ *    module.
+ */
+bool
+ljqo_baseline_active(void)
+{
+	return ljqo_baselines || capturing;
+}
+
+/*
+ * ljqo_baseline_lookup:
+ *    Replays the baseline of "problem". Returns NULL if there is none, or
+ *    if it is not legal for the query being planned.
+ */
+RelOptInfo *
+ljqo_baseline_lookup(PlannerInfo *root, ljqo_join_problem *problem)
+{
+	baseline_entry *entry;
+	baseline       *item;
+	RelOptInfo     *result;
+
+	if (!ljqo_baselines || !load_baselines())
+		return NULL;
+
+	entry = (baseline_entry *) hash_search(baselines,
+			&problem->shape_fingerprint, HASH_FIND, NULL);
+	if (entry == NULL)
+		return NULL;
+
+	for (item = entry->list; item != NULL; item = item->next)
+	{
+		if (item->nwords == problem->nshape_words &&
+			memcmp(item->words, problem->words,
+				   sizeof(uint32) * problem->nshape_words) == 0)
+			break;
+	}
+	if (item == NULL || item->nsteps != LJQO_JOIN_ORDER_STEPS(problem->nrels))
+		return NULL;
+
+	result = ljqo_join_order_replay(root, problem, item->steps);
+	if (result == NULL)
+		elog(DEBUG1, "join order baseline " UINT64_FORMAT " is not legal "
+			 "for this query and was ignored", problem->shape_fingerprint);
+
+	return result;
+}
+
+/*
+ * ljqo_baseline_note:
+ *    Records a join problem and the plan chosen for it while a baseline is
+ *    captured or dropped.
+ */
+void
+ljqo_baseline_note(ljqo_join_problem *problem, RelOptInfo *result)
+{
+	MemoryContext    oldcontext;
+	baseline_capture *capture;
+	int              nsteps = LJQO_JOIN_ORDER_STEPS(problem->nrels);
+	int             *steps;
+
+	if (!capturing)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(capture_context);
+
+	capture = (baseline_capture *) palloc(sizeof(baseline_capture));
+	capture->fingerprint = problem->shape_fingerprint;
+	capture->problem = int4_array((int32 *) problem->words,
+								  problem->nshape_words);
+	steps = (int *) palloc(sizeof(int) * 2 * Max(nsteps, 1));
+	if (ljqo_join_order_extract(problem, result, steps))
+		capture->join_order = int4_array(steps, 2 * nsteps);
+	else
+		capture->join_order = NULL;
+	pfree(steps);
+
+	captures = lappend(captures, capture);
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * collect_join_problems:
+ *    Plans "query" and returns the join problems solved by LJQO
+ *    (baseline_capture).
+ */
+static List *
+collect_join_problems(const char *query)
+{
+	List       *parsetrees = pg_parse_query(query);
+	List       *result;
+	ListCell   *lc;
+
+	capture_context = CurrentMemoryContext;
+	captures = NIL;
+	capturing = true;
+
+	PG_TRY();
+	{
+		foreach(lc, parsetrees)
+		{
+			List       *querytrees;
+			ListCell   *lc2;
+
+			querytrees = pg_analyze_and_rewrite((Node *) lfirst(lc), query,
+												NULL, 0);
+			foreach(lc2, querytrees)
+			{
+				Query      *querytree = (Query *) lfirst(lc2);
+
+				if (querytree->commandType != CMD_UTILITY)
+					pg_plan_query(querytree, 0, NULL);
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		capturing = false;
+		captures = NIL;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	capturing = false;
+	result = captures;
+	captures = NIL;
+
+	return result;
+}
+
+/*
+ * baseline_table:
+ *    Oid of the table of baselines. Raises an error if there is none.
+ */
+static Oid
+baseline_table(void)
+{
+	Oid         relid = baseline_relid();
+
+	if (!OidIsValid(relid))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("relation \"%s\" does not exist",
+						LJQO_BASELINE_QUALIFIED_TABLE),
+				 errhint("Run ljqo_baseline.sql in this database.")));
+
+	return relid;
+}
+
+/*
+ * delete_baseline:
+ *    Removes the baseline of "capture". Returns the number of rows removed.
+ */
+static int
+delete_baseline(baseline_capture *capture)
+{
+	Oid         argtypes[2] = {INT8OID, INT4ARRAYOID};
+	Datum       values[2];
+	int         ret;
+
+	values[0] = Int64GetDatum((int64) capture->fingerprint);
+	values[1] = PointerGetDatum(capture->problem);
+	ret = SPI_execute_with_args("DELETE FROM " LJQO_BASELINE_QUALIFIED_TABLE
+								" WHERE fingerprint OPERATOR(pg_catalog.=) $1"
+								" AND problem OPERATOR(pg_catalog.=) $2",
+								2, argtypes, values, NULL, false, 0);
+	if (ret != SPI_OK_DELETE)
+		elog(ERROR, "could not delete join order baseline: %s",
+			 SPI_result_code_string(ret));
+
+	return SPI_processed;
+}
+
+PG_FUNCTION_INFO_V1(ljqo_baseline_capture);
+
+/*
+ * ljqo_baseline_capture(query text) returns integer:
+ *    Plans "query" and pins the join order chosen for each of its join
+ *    problems solved by LJQO. Returns the number of baselines recorded.
+ */
+Datum
+ljqo_baseline_capture(PG_FUNCTION_ARGS)
+{
+	char       *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	Oid         relid = baseline_table();
+	List       *problems;
+	ListCell   *lc;
+	int         count = 0;
+
+	problems = collect_join_problems(query);
+
+	SPI_connect();
+	foreach(lc, problems)
+	{
+		baseline_capture *capture = (baseline_capture *) lfirst(lc);
+		Oid         argtypes[4] = {INT8OID, INT4ARRAYOID, INT4ARRAYOID,
+								   TEXTOID};
+		Datum       values[4];
+		int         ret;
+
+		if (capture->join_order == NULL)
+			continue;
+
+		delete_baseline(capture);
+
+		values[0] = Int64GetDatum((int64) capture->fingerprint);
+		values[1] = PointerGetDatum(capture->problem);
+		values[2] = PointerGetDatum(capture->join_order);
+		values[3] = CStringGetTextDatum(query);
+		ret = SPI_execute_with_args("INSERT INTO " LJQO_BASELINE_QUALIFIED_TABLE
+									" (fingerprint, problem, join_order, query)"
+									" VALUES ($1, $2, $3, $4)",
+									4, argtypes, values, NULL, false, 0);
+		if (ret != SPI_OK_INSERT)
+			elog(ERROR, "could not insert join order baseline: %s",
+				 SPI_result_code_string(ret));
+		count++;
+	}
+	SPI_finish();
+
+	CacheInvalidateRelcacheByRelid(relid);
+
+	PG_RETURN_INT32(count);
+}
+
+PG_FUNCTION_INFO_V1(ljqo_baseline_drop);
+
+/*
+ * ljqo_baseline_drop(query text) returns integer:
+ *    Removes the baselines of the join problems of "query". Returns the
+ *    number of baselines removed.
+ */
+Datum
+ljqo_baseline_drop(PG_FUNCTION_ARGS)
+{
+	char       *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	Oid         relid = baseline_table();
+	List       *problems;
+	ListCell   *lc;
+	int         count = 0;
+
+	problems = collect_join_problems(query);
+
+	SPI_connect();
+	foreach(lc, problems)
+		count += delete_baseline((baseline_capture *) lfirst(lc));
+	SPI_finish();
+
+	CacheInvalidateRelcacheByRelid(relid);
+
+	PG_RETURN_INT32(count);
+}
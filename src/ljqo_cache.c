@@ -0,0 +1,884 @@
+/*
+ * ljqo_cache.c
+ *
+ *   Cache of join orders (see ljqo_cache.h).
+ *
+ *   The per-backend cache keeps its entries in a hash table indexed by the
+ *   fingerprint of the join problem. The canonical form of the problem is
+ *   stored too, so different problems with the same fingerprint are never
+ *   confused. When the cache is full, the least recently used entry is
+ *   replaced.
+ *
+ *   The shared cache has fixed-size entries in shared memory and is only
+ *   available when the library is in shared_preload_libraries. Instead of
+ *   the canonical form, an entry keeps a second hash of it. Lookups only
+ *   take the lock in shared mode; hit counts are updated under a spinlock
+ *   of the entry. When it is full, the entry with the lowest (decaying)
+ *   hit count is replaced.
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#include "ljqo_cache.h"
+#include "ljqo_graph.h"
+
+#include <math.h>
+#include <miscadmin.h>
+#include <optimizer/pathnode.h>
+#include <optimizer/paths.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <storage/spin.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+
+/* extraction of a join order failed */
+#define EXTRACT_FAILED  INT_MIN
+
+/*
+ * cache_entry:
+ *    Join order of a join problem.
+ */
+typedef struct cache_entry
+{
+	uint64      fingerprint;  /* hash key, must be first */
+	uint32     *words;        /* canonical form of the problem */
+	int         nwords;
+	int        *steps;        /* join order, see ljqo_cache.h */
+	uint64      last_used;    /* value of cache_clock */
+} cache_entry;
+
+static MemoryContext cache_context = NULL;
+static HTAB         *cache = NULL;
+static uint64        cache_clock = 0;
+static long          cache_hits = 0;
+static long          cache_misses = 0;
+
+/*
+ * shared_entry:
+ *    Join order of a join problem in the shared cache.
+ */
+typedef struct shared_entry
+{
+	uint64      fingerprint;  /* hash key, must be first */
+	uint64      check;        /* problem_check() of the problem */
+	int         nrels;
+	slock_t     mutex;        /* protects usage */
+	double      usage;        /* decaying hit count */
+	int16       steps[2 * LJQO_JOIN_ORDER_STEPS(LJQO_SHARED_CACHE_MAX_RELS)];
+} shared_entry;
+
+/* entries lose this fraction of their usage on each eviction */
+#define SHARED_USAGE_DECAY  0.99
+
+/*
+ * shared_state:
+ *    Header of the shared cache.
+ */
+typedef struct shared_state
+{
+	LWLockId    lock;         /* protects the hash table */
+	slock_t     mutex;        /* protects the counters */
+	long        hits;
+	long        misses;
+} shared_state;
+
+static shared_state *shared = NULL;
+static HTAB         *shared_hash = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void local_store(ljqo_join_problem *problem, const int *steps);
+
+/*
+ * mix_hash:
+ *    64-bit finalizer (splitmix64).
+ */
+static inline uint64
+mix_hash(uint64 x)
+{
+	x = (x ^ (x >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+	x = (x ^ (x >> 27)) * UINT64CONST(0x94D049BB133111EB);
+	return x ^ (x >> 31);
+}
+
+/*
+ * rows_bucket:
+ *    Order of magnitude of a row estimate. Estimates that change with the
+ *    constants of a query usually stay in the same bucket.
+ */
+static inline uint32
+rows_bucket(double rows)
+{
+	if (rows < 1)
+		return 0;
+	return (uint32) log10(rows) + 1;
+}
+
+/*
+ * ljqo_join_problem_create:
+ *    Describes the join of "initial_rels". The canonical form holds, for
+ *    each relation in order, the range table index, kind and OID of each
+ *    of its base relations; then the edges of the query graph and the
+ *    special joins (outer, semi and anti joins) that restrict the join
+ *    order of these relations, which together are the shape of the
+ *    problem; then the bucket of the row estimate of each relation.
+ *
+ *    Problems with the same shape have the same legal join orders, so a
+ *    join order of one can be replayed for the other.
+ */
+ljqo_join_problem *
+ljqo_join_problem_create(PlannerInfo *root, List *initial_rels, int nrels)
+{
+	ljqo_join_problem *problem;
+	ljqo_graph *graph;
+	ListCell   *lc;
+	Relids      allrelids = NULL;
+	List       *special = NIL;
+	int         maxwords;
+	int         i = 0;
+	int         k;
+	uint64      h = 0;
+
+	problem = (ljqo_join_problem *) palloc(sizeof(ljqo_join_problem));
+	problem->nrels = nrels;
+	problem->rels = (RelOptInfo **) palloc(sizeof(RelOptInfo *) * nrels);
+	foreach(lc, initial_rels)
+		problem->rels[i++] = (RelOptInfo *) lfirst(lc);
+	Assert(i == nrels);
+
+	graph = ljqo_graph_create(root, problem->rels, nrels);
+
+	maxwords = 3 + 2 * nrels + 2 * graph->nedges;
+	for (i = 0; i < nrels; i++)
+	{
+		maxwords += 3 * bms_num_members(problem->rels[i]->relids);
+		allrelids = bms_add_members(allrelids, problem->rels[i]->relids);
+	}
+
+	/* special joins of these relations */
+	foreach(lc, root->join_info_list)
+	{
+		SpecialJoinInfo *sjinfo = (SpecialJoinInfo *) lfirst(lc);
+
+		if (!bms_overlap(sjinfo->min_lefthand, allrelids) &&
+			!bms_overlap(sjinfo->min_righthand, allrelids))
+			continue;
+		special = lappend(special, sjinfo);
+		maxwords += 4 + bms_num_members(sjinfo->min_lefthand)
+			+ bms_num_members(sjinfo->min_righthand);
+	}
+	problem->words = (uint32 *) palloc(sizeof(uint32) * maxwords);
+	problem->nwords = 0;
+
+#define ADD_WORD(w) (problem->words[problem->nwords++] = (uint32) (w))
+	ADD_WORD(nrels);
+	for (i = 0; i < nrels; i++)
+	{
+		RelOptInfo *rel = problem->rels[i];
+		Relids      tmp = bms_copy(rel->relids);
+		int         relid;
+
+		ADD_WORD(bms_num_members(rel->relids));
+		while ((relid = bms_first_member(tmp)) >= 0)
+		{
+			RangeTblEntry *rte = planner_rt_fetch(relid, root);
+
+			ADD_WORD(relid);
+			ADD_WORD(rte->rtekind);
+			ADD_WORD(rte->relid);
+		}
+		bms_free(tmp);
+	}
+	ADD_WORD(graph->nedges);
+	for (k = 0; k < 2 * graph->nedges; k++)
+		ADD_WORD(graph->edges[k]);
+	ADD_WORD(list_length(special));
+	foreach(lc, special)
+	{
+		SpecialJoinInfo *sjinfo = (SpecialJoinInfo *) lfirst(lc);
+		Relids      sides[2];
+		int         side;
+
+		ADD_WORD(sjinfo->jointype);
+		ADD_WORD(sjinfo->lhs_strict);
+		sides[0] = sjinfo->min_lefthand;
+		sides[1] = sjinfo->min_righthand;
+		for (side = 0; side < 2; side++)
+		{
+			Relids      tmp = bms_copy(sides[side]);
+			int         relid;
+
+			ADD_WORD(bms_num_members(sides[side]));
+			while ((relid = bms_first_member(tmp)) >= 0)
+				ADD_WORD(relid);
+			bms_free(tmp);
+		}
+	}
+	problem->nshape_words = problem->nwords;
+	for (i = 0; i < nrels; i++)
+		ADD_WORD(rows_bucket(problem->rels[i]->rows));
+#undef ADD_WORD
+	Assert(problem->nwords == maxwords);
+
+	ljqo_graph_destroy(graph);
+	list_free(special);
+	bms_free(allrelids);
+
+	for (k = 0; k < problem->nwords; k++)
+	{
+		if (k == problem->nshape_words)
+			problem->shape_fingerprint = h;
+		h = mix_hash(h * UINT64CONST(0x9E3779B97F4A7C15) + problem->words[k]);
+	}
+	problem->fingerprint = h;
+
+	return problem;
+}
+
+void
+ljqo_join_problem_destroy(ljqo_join_problem *problem)
+{
+	if (!problem)
+		return;
+
+	pfree(problem->words);
+	pfree(problem->rels);
+	pfree(problem);
+}
+
+/*
+ * extract_path:
+ *    Appends to "steps" the joins of the plan "path", children first.
+ *    Returns the code of the plan in a join order, or EXTRACT_FAILED.
+ */
+static int
+extract_path(ljqo_join_problem *problem, Path *path, int *steps, int *nsteps)
+{
+	RelOptInfo *rel;
+	JoinPath   *jpath;
+	int         outer,
+				inner;
+	int         i;
+
+	/* nodes that do not join */
+	while (IsA(path, MaterialPath) || IsA(path, UniquePath))
+	{
+		if (IsA(path, MaterialPath))
+			path = ((MaterialPath *) path)->subpath;
+		else
+			path = ((UniquePath *) path)->subpath;
+		if (path == NULL)
+			return EXTRACT_FAILED;
+	}
+
+	rel = path->parent;
+	for (i = 0; i < problem->nrels; i++)
+	{
+		if (bms_equal(rel->relids, problem->rels[i]->relids))
+			return i;
+	}
+
+	if (!IsA(path, NestPath) && !IsA(path, MergePath) && !IsA(path, HashPath))
+		return EXTRACT_FAILED;
+
+	jpath = (JoinPath *) path;
+	outer = extract_path(problem, jpath->outerjoinpath, steps, nsteps);
+	if (outer == EXTRACT_FAILED)
+		return EXTRACT_FAILED;
+	inner = extract_path(problem, jpath->innerjoinpath, steps, nsteps);
+	if (inner == EXTRACT_FAILED)
+		return EXTRACT_FAILED;
+
+	if (*nsteps >= LJQO_JOIN_ORDER_STEPS(problem->nrels))
+		return EXTRACT_FAILED;
+	steps[2 * (*nsteps)] = outer;
+	steps[2 * (*nsteps) + 1] = inner;
+	(*nsteps)++;
+
+	return -(*nsteps);
+}
+
+/*
+ * ljqo_join_order_extract:
+ *    Stores in "steps" (2 * LJQO_JOIN_ORDER_STEPS() ints) the join order of
+ *    the cheapest total path of "result". Returns false if it can not be
+ *    expressed in terms of the relations of "problem".
+ */
+bool
+ljqo_join_order_extract(ljqo_join_problem *problem, RelOptInfo *result,
+		int *steps)
+{
+	int         nsteps = 0;
+	int         code;
+
+	if (result == NULL || result->cheapest_total_path == NULL)
+		return false;
+
+	code = extract_path(problem, result->cheapest_total_path, steps, &nsteps);
+
+	return code != EXTRACT_FAILED
+		&& nsteps == LJQO_JOIN_ORDER_STEPS(problem->nrels);
+}
+
+/*
+ * ljqo_join_order_replay:
+ *    Builds the join order "steps" with make_join_rel(). Returns the final
+ *    join rel, or NULL if some join is not legal. In this case the join
+ *    rels made by the replay are removed from root->join_rel_list, as
+ *    GEQO does.
+ */
+RelOptInfo *
+ljqo_join_order_replay(PlannerInfo *root, ljqo_join_problem *problem,
+		const int *steps)
+{
+	int          nsteps = LJQO_JOIN_ORDER_STEPS(problem->nrels);
+	int          savelength = list_length(root->join_rel_list);
+	struct HTAB *savehash = root->join_rel_hash;
+	RelOptInfo **joins;
+	RelOptInfo  *result = NULL;
+	int          k;
+
+	joins = (RelOptInfo **) palloc(sizeof(RelOptInfo *) * Max(nsteps, 1));
+	/* the old hash must not see the joins of a failed replay */
+	root->join_rel_hash = NULL;
+
+	for (k = 0; k < nsteps; k++)
+	{
+		RelOptInfo *rel[2];
+		int         i;
+
+		for (i = 0; i < 2; i++)
+		{
+			int code = steps[2 * k + i];
+
+			if (code >= 0 && code < problem->nrels)
+				rel[i] = problem->rels[code];
+			else if (code < 0 && -code - 1 < k)
+				rel[i] = joins[-code - 1];
+			else
+				rel[i] = NULL;
+		}
+
+		if (rel[0] == NULL || rel[1] == NULL ||
+			bms_overlap(rel[0]->relids, rel[1]->relids))
+			break;
+
+		joins[k] = make_join_rel(root, rel[0], rel[1]);
+		if (joins[k] == NULL)
+			break;
+		set_cheapest(joins[k]);
+	}
+
+	if (k == nsteps && nsteps > 0)
+		result = joins[nsteps - 1];
+	else
+	{
+		root->join_rel_list = list_truncate(root->join_rel_list, savelength);
+		root->join_rel_hash = savehash;
+	}
+
+	pfree(joins);
+
+	return result;
+}
+
+/*
+ * problem_equals:
+ *    True if "entry" holds the join order of "problem".
+ */
+static bool
+problem_equals(cache_entry *entry, ljqo_join_problem *problem)
+{
+	return entry->nwords == problem->nwords
+		&& memcmp(entry->words, problem->words,
+				  sizeof(uint32) * problem->nwords) == 0;
+}
+
+static void
+remove_entry(cache_entry *entry)
+{
+	pfree(entry->words);
+	pfree(entry->steps);
+	hash_search(cache, &entry->fingerprint, HASH_REMOVE, NULL);
+}
+
+/*
+ * evict_lru:
+ *    Removes the least recently used entry. Only called on stores, after
+ *    an optimizer run, so a linear scan is cheap enough.
+ */
+static void
+evict_lru(void)
+{
+	HASH_SEQ_STATUS status;
+	cache_entry    *entry;
+	cache_entry    *victim = NULL;
+
+	hash_seq_init(&status, cache);
+	while ((entry = (cache_entry *) hash_seq_search(&status)) != NULL)
+	{
+		if (victim == NULL || entry->last_used < victim->last_used)
+			victim = entry;
+	}
+
+	if (victim)
+		remove_entry(victim);
+}
+
+/*
+ * local_lookup:
+ *    Replays the join order of "problem" kept by the per-backend cache.
+ */
+static RelOptInfo *
+local_lookup(PlannerInfo *root, ljqo_join_problem *problem)
+{
+	cache_entry *entry = NULL;
+	RelOptInfo  *result = NULL;
+
+	if (cache != NULL)
+		entry = (cache_entry *) hash_search(cache, &problem->fingerprint,
+											HASH_FIND, NULL);
+
+	if (entry != NULL && problem_equals(entry, problem))
+	{
+		result = ljqo_join_order_replay(root, problem, entry->steps);
+		if (result == NULL)
+			remove_entry(entry);	/* not legal anymore */
+	}
+
+	if (result != NULL)
+	{
+		entry->last_used = ++cache_clock;
+		cache_hits++;
+	}
+	else
+		cache_misses++;
+
+	return result;
+}
+
+/*
+ * local_store:
+ *    Stores the join order "steps" of "problem" in the per-backend cache.
+ */
+static void
+local_store(ljqo_join_problem *problem, const int *steps)
+{
+	int          nsteps = LJQO_JOIN_ORDER_STEPS(problem->nrels);
+	cache_entry *entry;
+	bool         found;
+
+	if (cache == NULL)
+	{
+		HASHCTL     hash_ctl;
+
+		cache_context = AllocSetContextCreate(TopMemoryContext,
+											  "LJQO Join Order Cache",
+											  ALLOCSET_DEFAULT_MINSIZE,
+											  ALLOCSET_DEFAULT_INITSIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(uint64);
+		hash_ctl.entrysize = sizeof(cache_entry);
+		hash_ctl.hash = tag_hash;
+		hash_ctl.hcxt = cache_context;
+		cache = hash_create("LJQO join order cache", 256, &hash_ctl,
+							HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	}
+
+	entry = (cache_entry *) hash_search(cache, &problem->fingerprint,
+										HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		if (hash_get_num_entries(cache) >= ljqo_cache_size)
+			evict_lru();
+		entry = (cache_entry *) hash_search(cache, &problem->fingerprint,
+											HASH_ENTER, &found);
+	}
+	else
+	{
+		/* same fingerprint: newer problem wins */
+		pfree(entry->words);
+		pfree(entry->steps);
+	}
+
+	entry->nwords = problem->nwords;
+	entry->words = (uint32 *) MemoryContextAlloc(cache_context,
+			sizeof(uint32) * problem->nwords);
+	memcpy(entry->words, problem->words, sizeof(uint32) * problem->nwords);
+	entry->steps = (int *) MemoryContextAlloc(cache_context,
+			sizeof(int) * 2 * Max(nsteps, 1));
+	memcpy(entry->steps, steps, sizeof(int) * 2 * nsteps);
+	entry->last_used = ++cache_clock;
+}
+
+/*
+ * shared_key:
+ *    Key of "problem" in the shared cache. The canonical form holds table
+ *    OIDs, which are unique only within a database, so the database is
+ *    part of the key.
+ */
+static inline uint64
+shared_key(ljqo_join_problem *problem)
+{
+	return mix_hash(problem->fingerprint ^
+					mix_hash((uint64) MyDatabaseId + UINT64CONST(1)));
+}
+
+/*
+ * problem_check:
+ *    Second hash of the canonical form of "problem" and of the database,
+ *    independent of its fingerprint. Entries of the shared cache are
+ *    matched by both.
+ */
+static uint64
+problem_check(ljqo_join_problem *problem)
+{
+	uint64      h = ((uint64) MyDatabaseId << 32) | (uint32) problem->nwords;
+	int         k;
+
+	for (k = 0; k < problem->nwords; k++)
+		h = mix_hash(h ^ (((uint64) problem->words[k] << 32) | (uint32) k));
+
+	return h;
+}
+
+/*
+ * shared_lookup:
+ *    Replays the join order of "problem" kept by the shared cache. The
+ *    order is copied under a shared lock and replayed after releasing it.
+ */
+static RelOptInfo *
+shared_lookup(PlannerInfo *root, ljqo_join_problem *problem)
+{
+	int          nsteps = LJQO_JOIN_ORDER_STEPS(problem->nrels);
+	uint64       key = shared_key(problem);
+	uint64       check = problem_check(problem);
+	shared_entry *entry;
+	int         *steps;
+	bool         found = false;
+	RelOptInfo  *result = NULL;
+	int          k;
+
+	steps = (int *) palloc(sizeof(int) * 2 * Max(nsteps, 1));
+
+	if (problem->nrels <= LJQO_SHARED_CACHE_MAX_RELS)
+	{
+		LWLockAcquire(shared->lock, LW_SHARED);
+		entry = (shared_entry *) hash_search(shared_hash,
+				&key, HASH_FIND, NULL);
+		if (entry != NULL && entry->check == check &&
+			entry->nrels == problem->nrels)
+		{
+			for (k = 0; k < 2 * nsteps; k++)
+				steps[k] = entry->steps[k];
+			found = true;
+
+			SpinLockAcquire(&entry->mutex);
+			entry->usage += 1;
+			SpinLockRelease(&entry->mutex);
+		}
+		LWLockRelease(shared->lock);
+	}
+
+	if (found)
+	{
+		result = ljqo_join_order_replay(root, problem, steps);
+		if (result == NULL)
+		{
+			/* not legal anymore */
+			LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+			entry = (shared_entry *) hash_search(shared_hash,
+					&key, HASH_FIND, NULL);
+			if (entry != NULL && entry->check == check)
+				hash_search(shared_hash, &key, HASH_REMOVE,
+							NULL);
+			LWLockRelease(shared->lock);
+		}
+		else if (ljqo_cache_size > 0)
+			local_store(problem, steps);
+	}
+	pfree(steps);
+
+	SpinLockAcquire(&shared->mutex);
+	if (result != NULL)
+		shared->hits++;
+	else
+		shared->misses++;
+	SpinLockRelease(&shared->mutex);
+
+	return result;
+}
+
+/*
+ * shared_evict:
+ *    Removes the entry with the lowest usage and decays the usage of the
+ *    others, so entries that stopped being used are replaced in time.
+ *    Called with the lock held in exclusive mode.
+ */
+static void
+shared_evict(void)
+{
+	HASH_SEQ_STATUS status;
+	shared_entry   *entry;
+	shared_entry   *victim = NULL;
+
+	hash_seq_init(&status, shared_hash);
+	while ((entry = (shared_entry *) hash_seq_search(&status)) != NULL)
+	{
+		if (victim == NULL || entry->usage < victim->usage)
+			victim = entry;
+		entry->usage *= SHARED_USAGE_DECAY;
+	}
+
+	if (victim)
+		hash_search(shared_hash, &victim->fingerprint, HASH_REMOVE, NULL);
+}
+
+/*
+ * shared_store:
+ *    Stores the join order "steps" of "problem" in the shared cache.
+ */
+static void
+shared_store(ljqo_join_problem *problem, const int *steps)
+{
+	int          nsteps = LJQO_JOIN_ORDER_STEPS(problem->nrels);
+	uint64       key = shared_key(problem);
+	shared_entry *entry;
+	bool         found;
+	int          k;
+
+	if (problem->nrels > LJQO_SHARED_CACHE_MAX_RELS)
+		return;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+
+	entry = (shared_entry *) hash_search(shared_hash, &key,
+										 HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		if (hash_get_num_entries(shared_hash) >= ljqo_shared_cache_size)
+			shared_evict();
+		entry = (shared_entry *) hash_search(shared_hash,
+				&key, HASH_ENTER_NULL, &found);
+		if (entry != NULL)
+		{
+			SpinLockInit(&entry->mutex);
+			entry->usage = 1;
+		}
+	}
+
+	/* an existing entry is replaced: other backends may have found it */
+	if (entry != NULL)
+	{
+		entry->check = problem_check(problem);
+		entry->nrels = problem->nrels;
+		for (k = 0; k < 2 * nsteps; k++)
+			entry->steps[k] = (int16) steps[k];
+	}
+
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * ljqo_cache_enabled:
+ *    True if some cache is in use.
+ */
+bool
+ljqo_cache_enabled(void)
+{
+	return ljqo_cache_size > 0 || shared != NULL;
+}
+
+/*
+ * ljqo_cache_lookup:
+ *    Replays the cached join order of "problem", from the per-backend cache
+ *    or else from the shared cache. Returns NULL on a miss.
+ */
+RelOptInfo *
+ljqo_cache_lookup(PlannerInfo *root, ljqo_join_problem *problem)
+{
+	RelOptInfo  *result = NULL;
+
+	if (ljqo_cache_size > 0)
+		result = local_lookup(root, problem);
+
+	if (result == NULL && shared != NULL)
+		result = shared_lookup(root, problem);
+
+	return result;
+}
+
+/*
+ * ljqo_cache_store:
+ *    Stores the join order of "result", the plan found for "problem".
+ */
+void
+ljqo_cache_store(ljqo_join_problem *problem, RelOptInfo *result)
+{
+	int          nsteps = LJQO_JOIN_ORDER_STEPS(problem->nrels);
+	int         *steps;
+
+	if (!ljqo_cache_enabled())
+		return;
+
+	steps = (int *) palloc(sizeof(int) * 2 * Max(nsteps, 1));
+	if (ljqo_join_order_extract(problem, result, steps))
+	{
+		if (ljqo_cache_size > 0)
+			local_store(problem, steps);
+		if (shared != NULL)
+			shared_store(problem, steps);
+	}
+	pfree(steps);
+}
+
+/*
+ * ljqo_cache_reset:
+ *    Removes every entry. Called when settings that change the plans of
+ *    the optimizers change.
+ */
+void
+ljqo_cache_reset(void)
+{
+	if (cache_context)
+		MemoryContextDelete(cache_context);
+	cache_context = NULL;
+	cache = NULL;
+}
+
+/*
+ * ljqo_cache_stats:
+ *    Counters of the cache, for "show ljqo_cache_stats".
+ */
+const char *
+ljqo_cache_stats(void)
+{
+	static char buf[256];
+	int         len;
+
+	len = snprintf(buf, sizeof(buf), "entries=%ld hits=%ld misses=%ld",
+				   cache ? hash_get_num_entries(cache) : 0L,
+				   cache_hits, cache_misses);
+
+	if (shared != NULL)
+	{
+		long        entries;
+		long        hits;
+		long        misses;
+
+		LWLockAcquire(shared->lock, LW_SHARED);
+		entries = hash_get_num_entries(shared_hash);
+		LWLockRelease(shared->lock);
+
+		SpinLockAcquire(&shared->mutex);
+		hits = shared->hits;
+		misses = shared->misses;
+		SpinLockRelease(&shared->mutex);
+
+		snprintf(buf + len, sizeof(buf) - len,
+				 " shared_entries=%ld shared_hits=%ld shared_misses=%ld",
+				 entries, hits, misses);
+	}
+
+	return buf;
+}
+
+/*
+ * shared_memsize:
+ *    Shared memory used by the shared cache.
+ */
+static Size
+shared_memsize(void)
+{
+	return add_size(MAXALIGN(sizeof(shared_state)),
+					hash_estimate_size(ljqo_shared_cache_size,
+									   sizeof(shared_entry)));
+}
+
+/*
+ * shared_startup:
+ *    shmem_startup_hook. Creates or attaches to the shared cache.
+ */
+static void
+shared_startup(void)
+{
+	HASHCTL     info;
+	bool        found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	shared = (shared_state *) ShmemInitStruct("LJQO Join Order Cache",
+											  sizeof(shared_state), &found);
+	if (!found)
+	{
+		shared->lock = LWLockAssign();
+		SpinLockInit(&shared->mutex);
+		shared->hits = 0;
+		shared->misses = 0;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(uint64);
+	info.entrysize = sizeof(shared_entry);
+	info.hash = tag_hash;
+	shared_hash = ShmemInitHash("LJQO join order cache hash",
+								ljqo_shared_cache_size, ljqo_shared_cache_size,
+								&info, HASH_ELEM | HASH_FUNCTION);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * ljqo_cache_shmem_request:
+ *    Called by _PG_init(). Reserves the shared cache when the library is
+ *    being loaded by shared_preload_libraries and ljqo_shared_cache_size
+ *    is set.
+ */
+void
+ljqo_cache_shmem_request(void)
+{
+	if (!process_shared_preload_libraries_in_progress ||
+		ljqo_shared_cache_size <= 0)
+		return;
+
+	RequestAddinShmemSpace(shared_memsize());
+	RequestAddinLWLocks(1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = shared_startup;
+}
+
+/*
+ * ljqo_cache_shmem_release:
+ *    Called by _PG_fini().
+ */
+void
+ljqo_cache_shmem_release(void)
+{
+	if (shmem_startup_hook == shared_startup)
+		shmem_startup_hook = prev_shmem_startup_hook;
+}
@@ -0,0 +1,537 @@
+/*
+ * ljqo_feedback.c
+ *
+ *   Planning effort tuned by execution feedback (see ljqo_feedback.h).
+ *
+ *   The join problems solved while a statement is planned are kept with
+ *   a key of its PlannedStmt, so that a prepared statement gives feedback
+ *   on each execution. The plan cache, SPI and the extended protocol
+ *   execute a copy of the planner's result (copyObject()), so the key is
+ *   computed from the contents of the statement that survive the copy:
+ *   its queryId (set by pg_stat_statements, if loaded), its range table
+ *   and the estimates of the top plan node (see statement_key()).
+ *   Statements with the same tables and the same estimates share an
+ *   entry, and the problems of the latest one are tuned. A cached generic
+ *   plan gives feedback, but the new budget is only used when the
+ *   statement is planned again.
+ *   The execution time is measured as pg_stat_statements does, with
+ *   queryDesc->totaltime.
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#include "ljqo_feedback.h"
+
+#include <executor/executor.h>
+#include <executor/instrument.h>
+#include <optimizer/planner.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+#include "ljqo_time_budget.h"
+
+/* limits of the per-backend tables */
+#define FEEDBACK_MAX_PROBLEMS  1024
+#define FEEDBACK_MAX_PLANS     256
+
+/* smallest budget given to a join problem */
+#define FEEDBACK_MIN_BUDGET_MS  1
+
+/* fraction of execution time that a larger budget must save */
+#define FEEDBACK_MIN_GAIN  0.05
+
+/* executions before a larger budget is tried again after a failed one */
+#define FEEDBACK_RETRY  32
+
+/*
+ * problem_entry:
+ *    Planning effort of a join problem.
+ */
+typedef struct problem_entry
+{
+	uint64      fingerprint;    /* hash key, must be first */
+	int         budget_ms;      /* budget of the next plans, 0 = default */
+	int         best_budget_ms; /* budget of the fastest execution, 0 = none */
+	double      best_exec_ms;   /* its execution time */
+	int         retry;          /* executions before trying a larger budget */
+	uint64      last_used;      /* value of feedback_clock */
+} problem_entry;
+
+/*
+ * planned_problem:
+ *    A join problem solved while a statement was planned.
+ */
+typedef struct planned_problem
+{
+	uint64      fingerprint;
+	int         budget_ms;      /* 0 = no limit */
+	double      plan_ms;
+} planned_problem;
+
+/*
+ * plan_entry:
+ *    Join problems of a planned statement.
+ */
+typedef struct plan_entry
+{
+	uint64      key;            /* hash key, must be first */
+	planned_problem *problems;
+	int         nproblems;
+	uint64      last_used;
+} plan_entry;
+
+static MemoryContext feedback_context = NULL;
+static HTAB         *problem_table = NULL;
+static HTAB         *plan_table = NULL;
+static uint64        feedback_clock = 0;
+
+/* join problems of the statement being planned (planned_problem) */
+static List         *planning = NIL;
+
+static planner_hook_type       prev_planner_hook = NULL;
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorEnd_hook_type   prev_ExecutorEnd = NULL;
+
+/*
+ * create_tables:
+ *    Creates the per-backend tables on first use.
+ */
+static void
+create_tables(void)
+{
+	HASHCTL     hash_ctl;
+
+	if (feedback_context != NULL)
+		return;
+
+	feedback_context = AllocSetContextCreate(TopMemoryContext,
+											 "LJQO Feedback",
+											 ALLOCSET_DEFAULT_MINSIZE,
+											 ALLOCSET_DEFAULT_INITSIZE,
+											 ALLOCSET_DEFAULT_MAXSIZE);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(uint64);
+	hash_ctl.entrysize = sizeof(problem_entry);
+	hash_ctl.hash = tag_hash;
+	hash_ctl.hcxt = feedback_context;
+	problem_table = hash_create("LJQO feedback problems", 256, &hash_ctl,
+								HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(uint64);
+	hash_ctl.entrysize = sizeof(plan_entry);
+	hash_ctl.hash = tag_hash;
+	hash_ctl.hcxt = feedback_context;
+	plan_table = hash_create("LJQO feedback plans", 64, &hash_ctl,
+							 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+}
+
+/*
+ * evict_problem:
+ *    Removes the least recently used join problem. Only called when a new
+ *    problem is planned, so a linear scan is cheap enough.
+ */
+static void
+evict_problem(void)
+{
+	HASH_SEQ_STATUS status;
+	problem_entry  *entry;
+	problem_entry  *victim = NULL;
+
+	hash_seq_init(&status, problem_table);
+	while ((entry = (problem_entry *) hash_seq_search(&status)) != NULL)
+	{
+		if (victim == NULL || entry->last_used < victim->last_used)
+			victim = entry;
+	}
+
+	if (victim)
+		hash_search(problem_table, &victim->fingerprint, HASH_REMOVE, NULL);
+}
+
+/*
+ * evict_plan:
+ *    Removes the least recently used statement.
+ */
+static void
+evict_plan(void)
+{
+	HASH_SEQ_STATUS status;
+	plan_entry     *entry;
+	plan_entry     *victim = NULL;
+
+	hash_seq_init(&status, plan_table);
+	while ((entry = (plan_entry *) hash_seq_search(&status)) != NULL)
+	{
+		if (victim == NULL || entry->last_used < victim->last_used)
+			victim = entry;
+	}
+
+	if (victim)
+	{
+		pfree(victim->problems);
+		hash_search(plan_table, &victim->key, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * mix_hash:
+ *    64-bit finalizer (splitmix64), as in ljqo_cache.c.
+ */
+static inline uint64
+mix_hash(uint64 x)
+{
+	x = (x ^ (x >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+	x = (x ^ (x >> 27)) * UINT64CONST(0x94D049BB133111EB);
+	return x ^ (x >> 31);
+}
+
+static inline uint64
+mix_double(uint64 h, double value)
+{
+	uint64      bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	return mix_hash(h ^ bits);
+}
+
+/*
+ * statement_key:
+ *    Key of a planned statement that is the same for its copies: command
+ *    type, queryId, kind and relation of each range table entry, and the
+ *    estimates of the top plan node.
+ */
+static uint64
+statement_key(PlannedStmt *stmt)
+{
+	uint64      h;
+	ListCell   *lc;
+	Plan       *plan = stmt->planTree;
+
+	h = mix_hash(((uint64) stmt->commandType << 32) | stmt->queryId);
+	foreach(lc, stmt->rtable)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+		h = mix_hash(h ^ (((uint64) rte->rtekind << 32) | rte->relid));
+	}
+
+	if (plan != NULL)
+	{
+		h = mix_hash(h ^ (uint64) nodeTag(plan));
+		h = mix_double(h, plan->startup_cost);
+		h = mix_double(h, plan->total_cost);
+		h = mix_double(h, plan->plan_rows);
+		h = mix_hash(h ^ (uint64) plan->plan_width);
+	}
+
+	return h;
+}
+
+/*
+ * ljqo_feedback_enabled:
+ *    True if the planning effort is tuned.
+ */
+bool
+ljqo_feedback_enabled(void)
+{
+	return ljqo_feedback_ratio > 0;
+}
+
+/*
+ * ljqo_feedback_budget:
+ *    Time budget (ms) of the algorithm that solves "problem":
+ *    ljqo_time_budget_ms until the problem has feedback.
+ */
+int
+ljqo_feedback_budget(ljqo_join_problem *problem)
+{
+	problem_entry *entry = NULL;
+
+	if (problem_table != NULL)
+		entry = (problem_entry *) hash_search(problem_table,
+				&problem->fingerprint, HASH_FIND, NULL);
+
+	if (entry == NULL || entry->budget_ms <= 0)
+		return ljqo_time_budget_ms;
+
+	entry->last_used = ++feedback_clock;
+
+	return entry->budget_ms;
+}
+
+/*
+ * ljqo_feedback_planned:
+ *    Records that "problem" was solved in "plan_ms" with the budget
+ *    "budget_ms" (0 = no limit) by the statement being planned.
+ */
+void
+ljqo_feedback_planned(ljqo_join_problem *problem, int budget_ms,
+					  double plan_ms)
+{
+	planned_problem *planned;
+
+	planned = (planned_problem *) palloc(sizeof(planned_problem));
+	planned->fingerprint = problem->fingerprint;
+	planned->budget_ms = budget_ms;
+	planned->plan_ms = plan_ms;
+
+	planning = lappend(planning, planned);
+}
+
+/*
+ * adjust_budget:
+ *    Tunes the budget of a join problem after an execution of "exec_ms"
+ *    whose share of planning time is "target_ms".
+ */
+static void
+adjust_budget(planned_problem *planned, double exec_ms, double target_ms)
+{
+	problem_entry *entry;
+	bool           found;
+	int            budget = planned->budget_ms;
+	bool           exhausted;
+
+	entry = (problem_entry *) hash_search(problem_table,
+			&planned->fingerprint, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		if (hash_get_num_entries(problem_table) >= FEEDBACK_MAX_PROBLEMS)
+			evict_problem();
+		entry = (problem_entry *) hash_search(problem_table,
+				&planned->fingerprint, HASH_ENTER, &found);
+		entry->budget_ms = 0;
+		entry->best_budget_ms = 0;
+		entry->best_exec_ms = 0;
+		entry->retry = 0;
+	}
+	entry->last_used = ++feedback_clock;
+
+	if (planned->plan_ms > target_ms)
+	{
+		/* planning takes more than its share: less search */
+		entry->budget_ms = Max((int) target_ms, FEEDBACK_MIN_BUDGET_MS);
+		entry->best_budget_ms = 0;
+		entry->retry = 0;
+		elog(DEBUG1, "LJQO feedback: budget of " UINT64_FORMAT
+			 " reduced to %d ms", planned->fingerprint, entry->budget_ms);
+		return;
+	}
+
+	/* a search that ended before its budget would not use a larger one */
+	exhausted = budget > 0 && planned->plan_ms >= budget;
+	if (!exhausted)
+		return;
+
+	if (entry->best_budget_ms == 0 || budget <= entry->best_budget_ms ||
+		exec_ms < entry->best_exec_ms * (1.0 - FEEDBACK_MIN_GAIN))
+	{
+		/* first execution, or the last increase paid off */
+		entry->best_budget_ms = budget;
+		entry->best_exec_ms = exec_ms;
+	}
+	else
+	{
+		/* more search did not make the execution faster */
+		entry->budget_ms = entry->best_budget_ms;
+		entry->retry = FEEDBACK_RETRY;
+		return;
+	}
+
+	if (entry->retry > 0)
+	{
+		entry->retry--;
+		return;
+	}
+
+	if (budget < (int) target_ms)
+	{
+		/* room for more search */
+		entry->budget_ms = (int) Min((double) budget * 2, target_ms);
+		elog(DEBUG1, "LJQO feedback: budget of " UINT64_FORMAT
+			 " increased to %d ms", planned->fingerprint, entry->budget_ms);
+	}
+}
+
+/*
+ * ljqo_feedback_planner:
+ *    Keeps the join problems solved while planning a statement with the
+ *    key of its PlannedStmt. A statement planned again with the same key
+ *    replaces the problems of the previous one.
+ */
+static PlannedStmt *
+ljqo_feedback_planner(Query *parse, int cursorOptions,
+					  ParamListInfo boundParams)
+{
+	List        *save_planning = planning;
+	PlannedStmt *result;
+
+	planning = NIL;
+	PG_TRY();
+	{
+		if (prev_planner_hook)
+			result = prev_planner_hook(parse, cursorOptions, boundParams);
+		else
+			result = standard_planner(parse, cursorOptions, boundParams);
+	}
+	PG_CATCH();
+	{
+		planning = save_planning;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (planning != NIL && ljqo_feedback_enabled())
+	{
+		plan_entry *entry;
+		uint64      key = statement_key(result);
+		bool        found;
+		ListCell   *lc;
+		int         i = 0;
+
+		create_tables();
+
+		entry = (plan_entry *) hash_search(plan_table, &key,
+										   HASH_FIND, NULL);
+		if (entry != NULL)
+			pfree(entry->problems);
+		else
+		{
+			if (hash_get_num_entries(plan_table) >= FEEDBACK_MAX_PLANS)
+				evict_plan();
+			entry = (plan_entry *) hash_search(plan_table, &key,
+											   HASH_ENTER, &found);
+		}
+		entry->nproblems = list_length(planning);
+		entry->problems = (planned_problem *)
+			MemoryContextAlloc(feedback_context,
+							   sizeof(planned_problem) * entry->nproblems);
+		foreach(lc, planning)
+			entry->problems[i++] = *(planned_problem *) lfirst(lc);
+		entry->last_used = ++feedback_clock;
+	}
+
+	list_free_deep(planning);
+	planning = save_planning;
+
+	return result;
+}
+
+/*
+ * find_plan:
+ *    Join problems of "stmt" (or of a copy of it), or NULL.
+ */
+static plan_entry *
+find_plan(PlannedStmt *stmt)
+{
+	uint64      key;
+
+	if (plan_table == NULL || stmt == NULL ||
+		hash_get_num_entries(plan_table) == 0)
+		return NULL;
+
+	key = statement_key(stmt);
+	return (plan_entry *) hash_search(plan_table, &key, HASH_FIND, NULL);
+}
+
+/*
+ * ljqo_feedback_ExecutorStart:
+ *    Measures the execution of statements with join problems.
+ */
+static void
+ljqo_feedback_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	if (ljqo_feedback_enabled() && queryDesc->totaltime == NULL &&
+		!(eflags & EXEC_FLAG_EXPLAIN_ONLY) &&
+		find_plan(queryDesc->plannedstmt) != NULL)
+	{
+		MemoryContext oldcxt;
+
+		oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_TIMER);
+		MemoryContextSwitchTo(oldcxt);
+	}
+}
+
+/*
+ * ljqo_feedback_ExecutorEnd:
+ *    Tunes the budgets of the join problems of the statement.
+ */
+static void
+ljqo_feedback_ExecutorEnd(QueryDesc *queryDesc)
+{
+	plan_entry *entry;
+
+	if (ljqo_feedback_enabled() && queryDesc->totaltime != NULL &&
+		(entry = find_plan(queryDesc->plannedstmt)) != NULL)
+	{
+		double      exec_ms;
+		double      target_ms;
+		int         i;
+
+		InstrEndLoop(queryDesc->totaltime);
+		exec_ms = queryDesc->totaltime->total * 1000.0;
+		/* the problems of a statement share its planning time */
+		target_ms = ljqo_feedback_ratio * exec_ms / entry->nproblems;
+
+		entry->last_used = ++feedback_clock;
+		for (i = 0; i < entry->nproblems; i++)
+			adjust_budget(&entry->problems[i], exec_ms, target_ms);
+	}
+
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+/*
+ * ljqo_feedback_init:
+ *    Installs the hooks. Called by _PG_init().
+ */
+void
+ljqo_feedback_init(void)
+{
+	prev_planner_hook = planner_hook;
+	planner_hook = ljqo_feedback_planner;
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = ljqo_feedback_ExecutorStart;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = ljqo_feedback_ExecutorEnd;
+}
+
+/*
+ * ljqo_feedback_fini:
+ *    Removes the hooks. Called by _PG_fini().
+ */
+void
+ljqo_feedback_fini(void)
+{
+	planner_hook = prev_planner_hook;
+	ExecutorStart_hook = prev_ExecutorStart;
+	ExecutorEnd_hook = prev_ExecutorEnd;
+}
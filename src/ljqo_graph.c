@@ -0,0 +1,446 @@
+/*
+ * ljqo_graph.c
+ *
+ *   Construction of the query graph shared by the LJQO optimizers.
+ *
+ *   Instead of testing every pair of relations, candidate pairs are taken
+ *   from the planner structures that can make two relations joinable: the
+ *   join clauses of each relation, the equivalence classes, the special
+ *   joins (join_info_list) and, from 9.3 on, lateral references and
+ *   placeholders. Each candidate is then confirmed with the same tests used
+ *   by the standard join search (have_relevant_joinclause() and
+ *   have_join_order_restriction()), so the graph is the one the exhaustive
+ *   O(n^2) probing would give, built in time proportional to its edges.
+ *
+ * Copyright (C) 2009-2014, Adriano Lange
+ *
+ * This file is part of LJQO Plugin.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose, without fee, and without a written agreement
+ * is hereby granted, provided that the above copyright notice and this
+ * paragraph and the following two paragraphs appear in all copies.
+ *
+ * IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS
+ * DOCUMENTATION, EVEN IF THE AUTHOR OR DISTRIBUTORS HAVE BEEN ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE AUTHOR AND DISTRIBUTORS SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUTHOR AND DISTRIBUTORS HAS NO OBLIGATIONS TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+#include "ljqo_graph.h"
+
+#include <optimizer/paths.h>
+#include <optimizer/joininfo.h>
+
+/*
+ * graph_builder:
+ *    Working data of ljqo_graph_create().
+ */
+typedef struct graph_builder
+{
+	PlannerInfo *root;
+	RelOptInfo **rels;
+	int          nrels;
+	int         *relid_map;   /* relid -> index in rels, or -1 */
+	int          relid_map_size;
+	int         *members;     /* output of map_relids() */
+	int         *stamp;       /* de-duplication in map_relids() */
+	int          stamp_value;
+	int         *pairs;       /* candidate pairs (i < j) */
+	int          npairs;
+	int          maxpairs;
+	bool         all_pairs;   /* candidates can not be derived */
+} graph_builder;
+
+/*
+ * map_relids:
+ *    Stores in builder->members the distinct indexes of the relations that
+ *    contain some relid of "relids". Returns the number of indexes.
+ */
+static int
+map_relids(graph_builder *builder, Relids relids)
+{
+	Relids  tmp;
+	int     relid;
+	int     count = 0;
+
+	if (bms_is_empty(relids))
+		return 0;
+
+	builder->stamp_value++;
+	tmp = bms_copy(relids);
+	while ((relid = bms_first_member(tmp)) >= 0)
+	{
+		int idx;
+
+		if (relid >= builder->relid_map_size)
+			continue;
+		idx = builder->relid_map[relid];
+		if (idx < 0 || builder->stamp[idx] == builder->stamp_value)
+			continue;
+
+		builder->stamp[idx] = builder->stamp_value;
+		builder->members[count++] = idx;
+	}
+	bms_free(tmp);
+
+	return count;
+}
+
+static void
+add_pair(graph_builder *builder, int i, int j)
+{
+	if (i == j)
+		return;
+
+	if (builder->npairs == builder->maxpairs)
+	{
+		builder->maxpairs *= 2;
+		builder->pairs = (int *) repalloc(builder->pairs,
+				sizeof(int) * 2 * builder->maxpairs);
+	}
+
+	builder->pairs[2 * builder->npairs]     = Min(i, j);
+	builder->pairs[2 * builder->npairs + 1] = Max(i, j);
+	builder->npairs++;
+}
+
+/*
+ * add_clique:
+ *    Adds a candidate pair for each two relations in builder->members.
+ */
+static void
+add_clique(graph_builder *builder, int count)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++)
+		for (j = i + 1; j < count; j++)
+			add_pair(builder, builder->members[i], builder->members[j]);
+}
+
+/*
+ * add_star:
+ *    Adds a candidate pair between "center" and each relation in
+ *    builder->members.
+ */
+static void
+add_star(graph_builder *builder, int center, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		add_pair(builder, center, builder->members[i]);
+}
+
+static void
+collect_candidates(graph_builder *builder)
+{
+	PlannerInfo *root = builder->root;
+	ListCell    *lc;
+	int          i;
+	int          count;
+
+	/* join clauses */
+	for (i = 0; i < builder->nrels; i++)
+	{
+		foreach(lc, builder->rels[i]->joininfo)
+		{
+			RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+			count = map_relids(builder, rinfo->required_relids);
+			add_star(builder, i, count);
+		}
+	}
+
+	/* equivalence classes (see have_relevant_eclass_joinclause()) */
+	foreach(lc, root->eq_classes)
+	{
+		EquivalenceClass *ec = (EquivalenceClass *) lfirst(lc);
+
+		if (list_length(ec->ec_members) <= 1)
+			continue;
+		count = map_relids(builder, ec->ec_relids);
+		add_clique(builder, count);
+	}
+
+	/* special joins (see have_join_order_restriction()) */
+	foreach(lc, root->join_info_list)
+	{
+		SpecialJoinInfo *sjinfo = (SpecialJoinInfo *) lfirst(lc);
+		Relids           hands;
+
+		/* an empty side matches any relation */
+		if (bms_is_empty(sjinfo->min_lefthand) ||
+			bms_is_empty(sjinfo->min_righthand))
+		{
+			builder->all_pairs = true;
+			return;
+		}
+
+		hands = bms_union(sjinfo->min_lefthand, sjinfo->min_righthand);
+		count = map_relids(builder, hands);
+		add_clique(builder, count);
+		bms_free(hands);
+	}
+
+#if PG_VERSION_NUM >= 90300
+	/* lateral references */
+	for (i = 0; i < builder->nrels; i++)
+	{
+		count = map_relids(builder, builder->rels[i]->lateral_relids);
+		add_star(builder, i, count);
+	}
+
+	/* placeholders */
+	foreach(lc, root->placeholder_list)
+	{
+		PlaceHolderInfo *phinfo = (PlaceHolderInfo *) lfirst(lc);
+
+		count = map_relids(builder, phinfo->ph_eval_at);
+		add_clique(builder, count);
+	}
+#endif
+}
+
+static int
+pair_cmp(const void *a, const void *b)
+{
+	const int *p1 = (const int *) a;
+	const int *p2 = (const int *) b;
+
+	if (p1[0] != p2[0])
+		return p1[0] < p2[0] ? -1 : 1;
+	if (p1[1] != p2[1])
+		return p1[1] < p2[1] ? -1 : 1;
+	return 0;
+}
+
+static bool
+is_edge(PlannerInfo *root, RelOptInfo *rel1, RelOptInfo *rel2)
+{
+	return !bms_overlap(rel1->relids, rel2->relids)
+		&& (have_relevant_joinclause(root, rel1, rel2) ||
+			have_join_order_restriction(root, rel1, rel2));
+}
+
+/*
+ * ljqo_graph_create:
+ *    Builds the query graph of "rels". The result is allocated in the
+ *    current memory context.
+ */
+ljqo_graph *
+ljqo_graph_create(PlannerInfo *root, RelOptInfo **rels, int nrels)
+{
+	graph_builder builder;
+	ljqo_graph   *graph;
+	int           i, k;
+
+	Assert(root && IsA(root, PlannerInfo));
+	Assert(nrels > 0);
+
+	memset(&builder, 0, sizeof(builder));
+	builder.root = root;
+	builder.rels = rels;
+	builder.nrels = nrels;
+	builder.relid_map_size = root->simple_rel_array_size;
+	builder.relid_map = (int *) palloc(sizeof(int) * builder.relid_map_size);
+	for (i = 0; i < builder.relid_map_size; i++)
+		builder.relid_map[i] = -1;
+	builder.members = (int *) palloc(sizeof(int) * nrels);
+	builder.stamp = (int *) palloc0(sizeof(int) * nrels);
+	builder.maxpairs = nrels * 2;
+	builder.pairs = (int *) palloc(sizeof(int) * 2 * builder.maxpairs);
+
+	for (i = 0; i < nrels; i++)
+	{
+		Relids tmp = bms_copy(rels[i]->relids);
+		int    relid;
+
+		while ((relid = bms_first_member(tmp)) >= 0)
+			if (relid < builder.relid_map_size)
+				builder.relid_map[relid] = i;
+		bms_free(tmp);
+	}
+
+	collect_candidates(&builder);
+
+	if (builder.all_pairs)
+	{
+		builder.npairs = 0;
+		for (i = 0; i < nrels; i++)
+			for (k = i + 1; k < nrels; k++)
+				add_pair(&builder, i, k);
+	}
+	else
+		qsort(builder.pairs, builder.npairs, sizeof(int) * 2, pair_cmp);
+
+	/* confirm the distinct candidates */
+	graph = (ljqo_graph *) palloc(sizeof(ljqo_graph));
+	graph->nrels = nrels;
+	graph->nedges = 0;
+	graph->edges = (int *) palloc(sizeof(int) * 2 * Max(builder.npairs, 1));
+	for (k = 0; k < builder.npairs; k++)
+	{
+		int *pair = &builder.pairs[2 * k];
+
+		if (k > 0 && pair_cmp(pair, pair - 2) == 0)
+			continue;
+		if (!is_edge(root, rels[pair[0]], rels[pair[1]]))
+			continue;
+
+		graph->edges[2 * graph->nedges]     = pair[0];
+		graph->edges[2 * graph->nedges + 1] = pair[1];
+		graph->nedges++;
+	}
+
+	/* adjacency arrays */
+	graph->adj_start = (int *) palloc0(sizeof(int) * (nrels + 1));
+	graph->adj = (int *) palloc(sizeof(int) * 2 * Max(graph->nedges, 1));
+	for (k = 0; k < graph->nedges; k++)
+	{
+		graph->adj_start[graph->edges[2 * k] + 1]++;
+		graph->adj_start[graph->edges[2 * k + 1] + 1]++;
+	}
+	for (i = 0; i < nrels; i++)
+		graph->adj_start[i + 1] += graph->adj_start[i];
+	{
+		int *next = builder.members; /* reused as insertion positions */
+
+		memcpy(next, graph->adj_start, sizeof(int) * nrels);
+		/* edges are sorted, so each list is filled in ascending order */
+		for (k = 0; k < graph->nedges; k++)
+			graph->adj[next[graph->edges[2 * k + 1]]++] = graph->edges[2 * k];
+		for (k = 0; k < graph->nedges; k++)
+			graph->adj[next[graph->edges[2 * k]]++] = graph->edges[2 * k + 1];
+	}
+
+	pfree(builder.relid_map);
+	pfree(builder.members);
+	pfree(builder.stamp);
+	pfree(builder.pairs);
+
+	return graph;
+}
+
+void
+ljqo_graph_destroy(ljqo_graph *graph)
+{
+	if (!graph)
+		return;
+
+	pfree(graph->edges);
+	pfree(graph->adj_start);
+	pfree(graph->adj);
+	pfree(graph);
+}
+
+/*
+ * ljqo_graph_classify:
+ *    Computes the number of components, of independent cycles and the
+ *    maximum degree of the graph, and classifies its shape.
+ */
+void
+ljqo_graph_classify(ljqo_graph *graph, ljqo_graph_stats *stats)
+{
+	int			n = graph->nrels;
+	int		   *component;
+	int		   *stack;
+	int			i,
+				k;
+
+	stats->components = 0;
+	stats->max_degree = 0;
+
+	/* components by depth-first search over the adjacency lists */
+	component = (int *) palloc(sizeof(int) * Max(n, 1));
+	stack = (int *) palloc(sizeof(int) * Max(n, 1));
+	for (i = 0; i < n; i++)
+		component[i] = -1;
+
+	for (i = 0; i < n; i++)
+	{
+		int			top = 0;
+
+		stats->max_degree = Max(stats->max_degree, ljqo_graph_degree(graph, i));
+
+		if (component[i] >= 0)
+			continue;
+
+		component[i] = stats->components;
+		stack[top++] = i;
+		while (top > 0)
+		{
+			int			rel = stack[--top];
+
+			for (k = graph->adj_start[rel]; k < graph->adj_start[rel + 1]; k++)
+			{
+				int			next = graph->adj[k];
+
+				if (component[next] < 0)
+				{
+					component[next] = stats->components;
+					stack[top++] = next;
+				}
+			}
+		}
+		stats->components++;
+	}
+
+	pfree(stack);
+	pfree(component);
+
+	stats->cycles = graph->nedges - n + stats->components;
+
+	if (stats->components > 1)
+		stats->shape = LJQO_GRAPH_DISCONNECTED;
+	else if (stats->cycles == 0)
+	{
+		if (stats->max_degree <= 2)
+			stats->shape = LJQO_GRAPH_CHAIN;
+		else if (stats->max_degree == n - 1)
+			stats->shape = LJQO_GRAPH_STAR;
+		else
+			stats->shape = LJQO_GRAPH_TREE;
+	}
+	else if (graph->nedges == n * (n - 1) / 2)
+		stats->shape = LJQO_GRAPH_CLIQUE;
+	else if (stats->cycles == 1 && stats->max_degree == 2)
+		stats->shape = LJQO_GRAPH_CYCLE;
+	else
+		stats->shape = LJQO_GRAPH_CYCLIC;
+}
+
+/*
+ * ljqo_graph_shape_name:
+ *    Name of a shape, for messages.
+ */
+const char *
+ljqo_graph_shape_name(ljqo_graph_shape shape)
+{
+	switch (shape)
+	{
+		case LJQO_GRAPH_CHAIN:
+			return "chain";
+		case LJQO_GRAPH_STAR:
+			return "star";
+		case LJQO_GRAPH_TREE:
+			return "tree";
+		case LJQO_GRAPH_CYCLE:
+			return "cycle";
+		case LJQO_GRAPH_CLIQUE:
+			return "clique";
+		case LJQO_GRAPH_CYCLIC:
+			return "cyclic";
+		case LJQO_GRAPH_DISCONNECTED:
+			return "disconnected";
+	}
+	return "unknown";
+}
@@ -21,6 +21,10 @@
 #include "sdp_mem_ctx.h"
 #include "sdp_debug.h"
 #include "opte.h"
+#include "ljqo_random.h"
+#include "ljqo_time_budget.h"
+#include "ljqo_graph.h"
+#include "ljqo_paths.h"
 #include "debuggraph_rel.h"
 
 #include <nodes/nodes.h>
@@ -28,6 +32,7 @@
 #include <optimizer/pathnode.h>
 #include <optimizer/joininfo.h>
 #include <utils/memutils.h>
+#include <utils/hsearch.h>
 #include <lib/stringinfo.h>
 
 /*---------------------- CONFIGURATION VARIABLES -------------------------*/
@@ -39,6 +44,9 @@ int sdp_iteration_slope   = DEFAULT_SDP_ITERATION_SLOPE;
 int sdp_iteration_const   = DEFAULT_SDP_ITERATION_CONST;
 int sdp_min_iterations    = DEFAULT_SDP_MIN_ITERATIONS;
 int sdp_max_iterations    = DEFAULT_SDP_MAX_ITERATIONS;
+int sdp_dp_window         = DEFAULT_SDP_DP_WINDOW;
+int sdp_top_sequences     = DEFAULT_SDP_TOP_SEQUENCES;
+int sdp_adaptive_stop     = DEFAULT_SDP_ADAPTIVE_STOP;
 
 /*------------------------ MAIN INTERNAL TYPES ---------------------------*/
 /**
@@ -46,13 +54,26 @@ int sdp_max_iterations    = DEFAULT_SDP_MAX_ITERATIONS;
  *    Represents an edge in a query graph. Each edge is a possible join
  *    between two RelOptInfo's (node1 and node2). An array of this type
  *    forms a query graph.
+ *
+ *    mask1 and mask2 are the bits of node1 and node2 in relation masks
+ *    (the position of the node in private_data->node_list). They are used
+ *    only for queries with up to SDP_MASK_MAX_RELS relations.
  */
 typedef struct edge_type {
 	RelOptInfo* node1;
 	RelOptInfo* node2;
 	Relids      relids;
+	uint64      mask1;
+	uint64      mask2;
 } edge_type;
 
+/* S-phase works on uint64 relation masks up to this number of relations */
+#define SDP_MASK_MAX_RELS 64
+
+/* relative reduction of the minimum cost counted as an improvement by the
+ * adaptive stop of S-phase (sdp_adaptive_stop) */
+#define SDP_ADAPTIVE_EPSILON 0.001
+
 /**
  * edge_list_type:
  *    Represents an edge list or a query graph.
@@ -77,16 +98,35 @@ typedef struct private_data_type {
 	edge_list_type    edge_list; /* list of edges in a query graph */
 	root_join_rel_save_type save_root_join_rel;
 	Cost              s_phase_rel_cost;
+	ljqo_random_state random;    /* private PRNG used by the S-phase */
+	struct HTAB*      sample_memo; /* joins of the S-phase (s_phase_join) */
+	bool              use_rel_masks; /* edge masks are set (edge_type) */
+	int               sample_joins_built;
+	int               sample_joins_reused;
 	OPTE_DECLARE      ( *opte );
 } private_data_type;
 
+/**
+ * s_phase_top_type:
+ *    The cheapest distinct sequences (samples) found by S-phase, ordered by
+ *    cost. sequences has "size" arrays of nrels RelOptInfo*, allocated
+ *    before sampling; only the first "count" ones are used.
+ */
+typedef struct s_phase_top_type {
+	RelOptInfo*** sequences;
+	Cost*         costs;
+	int           count;
+	int           size;
+} s_phase_top_type;
+
 /*----------------------------- PROTOTYPES -------------------------------*/
 #define cheapest_total(rel) ((rel)->cheapest_total_path->total_cost)
 
 static void initiate_private_data(private_data_type* private_data,
 		PlannerInfo *root, int number_of_rels, List *initial_rels);
 static void finalize_private_data(private_data_type* private_data);
-static RelOptInfo** s_phase(private_data_type* private_data);
+static void s_phase(private_data_type* private_data, s_phase_top_type* top);
+static void s_phase_top_destroy(s_phase_top_type* top);
 static RelOptInfo* dp_phase(private_data_type* private_data,
 		RelOptInfo **sequence);
 static RelOptInfo* reconstruct_s_phase_rel(PlannerInfo *root,
@@ -104,8 +144,9 @@ sdp(PlannerInfo* root, int number_of_rels, List* initial_rels)
 {
 	private_data_type pdata; /*this variable must be initialized using
 	                                  initiate_private_data()*/
-	RelOptInfo** s_phase_sequence;
-	RelOptInfo*  ret;
+	s_phase_top_type s_phase_top; /* sequences elected by S-phase */
+	RelOptInfo*  ret = NULL;
+	int          k;
 
 	OPTE_GET_BY_PLANNERINFO( pdata.opte, root );
 
@@ -117,12 +158,21 @@ sdp(PlannerInfo* root, int number_of_rels, List* initial_rels)
 
 	/* ------------ calling the optimization phases: ------------ */
 	OPTE_PRINT_TIME( pdata.opte, "before_phase_1" );
-	s_phase_sequence = s_phase(&pdata);       /* phase 1: Sampling */
+	s_phase(&pdata, &s_phase_top);            /* phase 1: Sampling */
 
 	OPTE_PRINT_TIME( pdata.opte, "before_phase_2" );
 
-	ret = dp_phase(&pdata, s_phase_sequence); /* phase 2: Dynamic Prog. */
-	Assert(ret && IsA(ret, RelOptInfo) && ret->cheapest_total_path);
+	/* phase 2: Dynamic Prog. over each elected sequence. Join rels with the
+	 * same relids are shared by the runs (root->join_rel_list), so the
+	 * paths of all runs compete in the final rel. */
+	for( k=0; k < s_phase_top.count; k++ )
+	{
+		if( k && ljqo_time_budget_exhausted() )
+			break;
+		ret = dp_phase(&pdata, s_phase_top.sequences[k]);
+		Assert(ret && IsA(ret, RelOptInfo) && ret->cheapest_total_path);
+	}
+	opte_printf("Phase2 Sequences = %d", k);
 
 	OPTE_PRINT_TIME( pdata.opte, "after_phase_2" );
 	/* ------------ end of the optimization phases ------------ */
@@ -136,7 +186,8 @@ sdp(PlannerInfo* root, int number_of_rels, List* initial_rels)
 		elog(WARNING, "sdp's sampling phase generated the cheapest path."
 				" Trying to reconstruct it");
 		restore_root_join_rel(&pdata.save_root_join_rel, root);
-		aux = reconstruct_s_phase_rel(root, s_phase_sequence, number_of_rels);
+		aux = reconstruct_s_phase_rel(root, s_phase_top.sequences[0],
+				number_of_rels);
 		if (aux && aux->cheapest_total_path
 				&& cheapest_total(aux) < cheapest_total(ret))
 			ret = aux;
@@ -146,8 +197,7 @@ sdp(PlannerInfo* root, int number_of_rels, List* initial_rels)
 
 	/* ------------ finalizations ------------ */
 	finalize_private_data(&pdata);
-	Assert(s_phase_sequence);
-	pfree(s_phase_sequence);
+	s_phase_top_destroy(&s_phase_top);
 
 	Assert(ret && IsA(ret, RelOptInfo) && ret->cheapest_total_path);
 
@@ -181,10 +231,11 @@ is_it_a_possible_join(temp_context_type *saved_context, PlannerInfo *root,
 /**
  * create_edge:
  *    This function only sets the values of "out" variable according to
- *    rel1 and rel2.
+ *    rel1 and rel2, which are node_list[idx1] and node_list[idx2].
  */
 static inline void
-create_edge(edge_type* out, RelOptInfo* rel1, RelOptInfo* rel2)
+create_edge(edge_type* out, RelOptInfo* rel1, RelOptInfo* rel2,
+		int idx1, int idx2)
 {
 	Assert(IsA(rel1, RelOptInfo));
 	Assert(IsA(rel2, RelOptInfo));
@@ -193,6 +244,8 @@ create_edge(edge_type* out, RelOptInfo* rel1, RelOptInfo* rel2)
 	out->relids = bms_union(rel1->relids, rel2->relids);
 	out->node1 = rel1;
 	out->node2 = rel2;
+	out->mask1 = idx1 < SDP_MASK_MAX_RELS ? ((uint64) 1) << idx1 : 0;
+	out->mask2 = idx2 < SDP_MASK_MAX_RELS ? ((uint64) 1) << idx2 : 0;
 }
 
 /**
@@ -209,46 +262,52 @@ create_edge_list(private_data_type* private_data)
 	unsigned long int  max_size;
 	unsigned int       list_size = 0;
 	edge_type*    edge_list;
+	ljqo_graph*   graph;
 
 	SDP_DEBUG_MSG2_IN("> create_edge_list(private_data=%p)", private_data);
 
-	/* we assume number_of_rels^2 as the maximum size for the query graph */
-	max_size = (  (unsigned long int)private_data->number_of_rels
-	            * (unsigned long int)private_data->number_of_rels );
 	Assert(IsA(root, PlannerInfo));
 	Assert(private_data->number_of_rels > 0);
+
+	graph = ljqo_graph_create(root, private_data->node_list,
+			private_data->number_of_rels);
+
+	/* edges of the query graph, plus up to nrels-1 edges for each
+	 * relation without edges (see below) */
+	{
+		int i;
+		max_size = graph->nedges;
+		for(i=0; i<graph->nrels; i++)
+			if( ljqo_graph_degree(graph, i) == 0 )
+				max_size += graph->nrels - 1;
+	}
 	Assert((unsigned long int)UINT_MAX > max_size);
 
-	edge_list = palloc(sizeof(edge_type) * max_size);
+	edge_list = palloc(sizeof(edge_type) * Max(max_size, 1));
 	{
 		temp_context_type save_context;
-		int i, j;
+		int i, j, k;
 		int nrels = private_data->number_of_rels;
 		bool* used = palloc0(sizeof(bool) * nrels);
 
 		temporary_context_create(&save_context);
 		clear_root_join_rel(&private_data->save_root_join_rel, root);
 
-		for(i=0; i<nrels; i++)
+		for(k=0; k<graph->nedges; k++)
 		{
-			RelOptInfo* rel1 = private_data->node_list[i];
+			RelOptInfo* rel1;
+			RelOptInfo* rel2;
 
-			for(j=i+1; j<nrels; j++)
-			{
-				RelOptInfo* rel2 = private_data->node_list[j];
+			i = graph->edges[2*k];
+			j = graph->edges[2*k+1];
+			rel1 = private_data->node_list[i];
+			rel2 = private_data->node_list[j];
+			used[i] = used[j] = true;
 
-				if ((have_relevant_joinclause(root, rel1, rel2) ||
-				       have_join_order_restriction(root, rel1, rel2))
-				    /*&& is_it_a_possible_join(&save_context, rel1, rel2)*/)
-				{
-					used[i] = used[j] = true;
-
-					SDP_DEBUG_MSG2_IN("  create_edge_list() edge_list[%u] = "
-							"(%u,%u)", list_size, rel1->relid, rel2->relid);
+			SDP_DEBUG_MSG2_IN("  create_edge_list() edge_list[%u] = "
+					"(%u,%u)", list_size, rel1->relid, rel2->relid);
 
-					create_edge(&edge_list[list_size++], rel1, rel2);
-				}
-			}
+			create_edge(&edge_list[list_size++], rel1, rel2, i, j);
 		}
 		/*
 		 * Search for not used rels. All rels must be in the query graph.
@@ -275,7 +334,8 @@ create_edge_list(private_data_type* private_data)
 									list_size, rel1->relid, rel2->relid);
 
 							used[i] = true;
-							create_edge(&edge_list[list_size++], rel1, rel2);
+							create_edge(&edge_list[list_size++], rel1, rel2,
+									i, j);
 						}
 					}
 				}
@@ -289,9 +349,12 @@ create_edge_list(private_data_type* private_data)
 		restore_root_join_rel(&private_data->save_root_join_rel, root);
 		temporary_context_destroy(&save_context);
 	}
+	ljqo_graph_destroy(graph);
 
 	private_data->edge_list.size = list_size;
 	private_data->edge_list.list = edge_list;
+	private_data->use_rel_masks =
+			private_data->number_of_rels <= SDP_MASK_MAX_RELS;
 
 	SDP_DEBUG_MSG2_IN("  create_edge_list() edge_list_size=%u",
 			private_data->edge_list.size);
@@ -356,6 +419,8 @@ initiate_private_data(private_data_type* private_data, PlannerInfo *root,
 	create_edge_list(private_data);
 
 	private_data->s_phase_rel_cost = 0;
+	ljqo_random_init(&private_data->random);
+	private_data->sample_memo = NULL;
 
 	SDP_DEBUG_MSG2_IN("< initiate_private_data()");
 	/* at this point the private_data is complete */
@@ -386,6 +451,72 @@ typedef struct sample_return_type
 	int          rel_count;
 } sample_return_type;
 
+/**
+ * sample_memo_key, sample_memo_entry:
+ *    Joins made by the S-phase are kept in private_data->sample_memo for the
+ *    whole phase. The key is the pair of joined RelOptInfos, ordered by
+ *    address. As every joined RelOptInfo is itself taken from the memo, a
+ *    pair identifies the whole join sequence (prefix) that built it, not
+ *    only its relids: samples sharing a prefix share its RelOptInfos.
+ */
+typedef struct sample_memo_key
+{
+	RelOptInfo*  rel[2];
+} sample_memo_key;
+
+typedef struct sample_memo_entry
+{
+	sample_memo_key key;  /* must be the first field */
+	RelOptInfo*     join; /* NULL if the join is not possible */
+} sample_memo_entry;
+
+/**
+ * s_phase_join:
+ *    make_join_rel() for the S-phase. A join already made by an earlier
+ *    sample is taken from the memo, with its paths already costed.
+ */
+static RelOptInfo*
+s_phase_join(private_data_type* private_data, RelOptInfo* rel1,
+		RelOptInfo* rel2)
+{
+	sample_memo_key    key;
+	sample_memo_entry* entry;
+	bool               found;
+	int                num_join_rels;
+
+	if( rel1 < rel2 )
+	{
+		key.rel[0] = rel1;
+		key.rel[1] = rel2;
+	}
+	else
+	{
+		key.rel[0] = rel2;
+		key.rel[1] = rel1;
+	}
+
+	entry = (sample_memo_entry*) hash_search(private_data->sample_memo,
+			&key, HASH_ENTER, &found);
+	if( found )
+	{
+		private_data->sample_joins_reused++;
+		return entry->join;
+	}
+
+	num_join_rels = list_length(private_data->root->join_rel_list);
+	entry->join = make_join_rel(private_data->root, rel1, rel2);
+	if( entry->join )
+	{
+		set_cheapest(entry->join);
+		/* the S-phase only reads the cheapest total path */
+		ljqo_reduce_paths(entry->join,
+				list_length(private_data->root->join_rel_list) > num_join_rels);
+	}
+	private_data->sample_joins_built++;
+
+	return entry->join;
+}
+
 static inline void
 swap_edge(edge_type* e1, edge_type* e2)
 {
@@ -401,24 +532,30 @@ swap_edge(edge_type* e1, edge_type* e2)
  *    a RelOptInfo* from a random sequence of joins. Indeed, the sequence is
  *    more important than the RelOptInfo*. The later is used only to compare
  *    its cost with the cost of other generated sequences in s_phase().
+ *
+ *    When private_data->use_rel_masks is set, the relations of cur_rel are
+ *    tracked in a uint64 mask (cur_mask) and the edges are tested against
+ *    it without touching Bitmapsets.
  */
 static List*
 s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
-		PlannerInfo* root, int nrels)
+		int nrels, private_data_type* private_data)
 {
+	ljqo_random_state* rnd = &private_data->random;
 	sample_return_type* return_item = palloc(sizeof(sample_return_type));
 	RelOptInfo* cur_rel = NULL;
 	List* ret_list = NULL;
 	int i;
 	int rel_count;
 	int edge_list_size = edge_list->size;
+	bool use_masks = private_data->use_rel_masks;
+	uint64 cur_mask = 0; /* relations of cur_rel (if use_masks) */
 
 	SDP_DEBUG_MSG2_SS("> s_phase_get_a_sample(edge_list(%d), nrels=%d)",
 					edge_list->size, nrels);
 
 	for( i=0, rel_count=0; i < edge_list_size && rel_count < nrels; )
 	{
-		Relids intersection;
 		int j = i;
 		int r;
 
@@ -428,7 +565,10 @@ s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
 		/* This while is only an increment for both i and j. */
 		while(j<edge_list_size)
 		{
-			r = random() % (edge_list_size - j);
+			bool overlap;
+			bool covered;
+
+			r = ljqo_random_int(rnd, edge_list_size - j);
 
 			if( r )
 				/* swap [j] <--> [j+r] */
@@ -437,28 +577,39 @@ s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
 			if( cur_rel == NULL ) /* or rel_count == 0 */
 				break; /* we don't need select other r for now */
 
-			if(!bms_overlap(cur_rel->relids,edge_list->list[j].relids))
+			if( use_masks )
+			{
+				uint64 edge_mask = edge_list->list[j].mask1
+				                 | edge_list->list[j].mask2;
+				overlap = (cur_mask & edge_mask) != 0;
+				covered = (edge_mask & ~cur_mask) == 0;
+			}
+			else
+			{
+				overlap = bms_overlap(cur_rel->relids,
+						edge_list->list[j].relids);
+				covered = overlap && bms_is_subset(edge_list->list[j].relids,
+						cur_rel->relids);
+			}
+
+			if( !overlap )
 			{
 				j++;
 				continue;
 			}
 
-			intersection = bms_intersect(cur_rel->relids,
-					edge_list->list[j].relids);
-			if( bms_equal(intersection, edge_list->list[j].relids) )
+			if( covered )
 			{ /* we don't need edge_list->list[j]. Discarding it.. */
 				if( i != j )
 					/* swap [i] <--> [j] */
 					swap_edge(&edge_list->list[i], &edge_list->list[j]);
 
 				j = ++i;
-				bms_free(intersection);
 				continue;
 			}
 
 			/* [j] doesn't have complete overlap with cur_rel.
 			 * This is a good choice. */
-			bms_free(intersection);
 			break;
 		}
 		SDP_DEBUG_MSG2_SS("  s_phase_get_a_sample(): i=%d, rel_count=%d, j=%d",
@@ -479,8 +630,8 @@ s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
 		{
 			SDP_DEBUG_MSG2_SS("  s_phase_get_a_sample(): edge_list->list[i]: "
 					"cur_rel == NULL");
-			cur_rel = make_join_rel(root, edge_list->list[i].node1,
-			                              edge_list->list[i].node2);
+			cur_rel = s_phase_join(private_data, edge_list->list[i].node1,
+			                                     edge_list->list[i].node2);
 			if( cur_rel )
 			{
 				SDP_DEBUG_MSG2_SS("  s_phase_get_a_sample(): edge_list->list[i]: "
@@ -488,7 +639,7 @@ s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
 						edge_list->list[i].node2->relid);
 				cur_rels[rel_count++] = edge_list->list[i].node1;
 				cur_rels[rel_count++] = edge_list->list[i].node2;
-				set_cheapest(cur_rel);
+				cur_mask = edge_list->list[i].mask1 | edge_list->list[i].mask2;
 			}
 			i++;
 		}
@@ -507,12 +658,13 @@ s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
 			      && bms_overlap(cur_rel->relids,
 			                     edge_list->list[i].node2->relids)));
 
-			if( bms_overlap(cur_rel->relids,
-			                edge_list->list[i].node1->relids) )
+			if( use_masks ? (cur_mask & edge_list->list[i].mask1) != 0
+			              : bms_overlap(cur_rel->relids,
+			                            edge_list->list[i].node1->relids) )
 			{
 				SDP_DEBUG_MSG2_SS("  s_phase_get_a_sample(): edge_list->list[i]: "
 						"joining %u", edge_list->list[i].node2->relid);
-				join = make_join_rel(root, cur_rel,
+				join = s_phase_join(private_data, cur_rel,
 						edge_list->list[i].node2);
 				if( join )
 				{
@@ -520,15 +672,17 @@ s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
 							"joined %u", edge_list->list[i].node2->relid);
 					cur_rel = join;
 					cur_rels[rel_count++] = edge_list->list[i].node2;
+					cur_mask |= edge_list->list[i].mask2;
 				}
 			}
 			else
-			if( bms_overlap(cur_rel->relids,
-			                edge_list->list[i].node2->relids) )
+			if( use_masks ? (cur_mask & edge_list->list[i].mask2) != 0
+			              : bms_overlap(cur_rel->relids,
+			                            edge_list->list[i].node2->relids) )
 			{
 				SDP_DEBUG_MSG2_SS("  s_phase_get_a_sample(): edge_list->list[i]: "
 						"joining %u", edge_list->list[i].node1->relid);
-				join = make_join_rel(root, cur_rel,
+				join = s_phase_join(private_data, cur_rel,
 						edge_list->list[i].node1);
 				if( join )
 				{
@@ -536,9 +690,9 @@ s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
 							"joined %u", edge_list->list[i].node1->relid);
 					cur_rel = join;
 					cur_rels[rel_count++] = edge_list->list[i].node1;
+					cur_mask |= edge_list->list[i].mask1;
 				}
 			}
-			set_cheapest(cur_rel);
 			i++;
 		}
 		else /* j was exhausted. [i] is not connected to cur_rel */
@@ -573,8 +727,8 @@ s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
 		edge_list2.list = &edge_list->list[edge_list_size];
 		edge_list2.size = edge_list->size - edge_list_size;
 
-		ret_list = s_phase_get_a_sample(&edge_list2, &cur_rels[rel_count], root,
-				nrels - rel_count);
+		ret_list = s_phase_get_a_sample(&edge_list2, &cur_rels[rel_count],
+				nrels - rel_count, private_data);
 
 	}
 
@@ -603,12 +757,11 @@ s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
 				Assert(IsA(cur_rel2, RelOptInfo));
 				Assert(!bms_overlap(cur_rel->relids, cur_rel2->relids));
 
-				join = make_join_rel(root, cur_rel, cur_rel2);
+				join = s_phase_join(private_data, cur_rel, cur_rel2);
 				if( join ) /* join is possible between cur_rel and cur_rel2 */
 				{          /* perform a merge of them */
 					/* new cur_rel */
 					cur_rel = join;
-					set_cheapest(cur_rel);
 
 					/* add merged list of RelOptInfos to cur_rels_aux */
 					memcpy(&cur_rels_aux[rel_count],
@@ -675,22 +828,87 @@ s_phase_get_a_sample(edge_list_type* edge_list, RelOptInfo** cur_rels,
 	return ret_list;
 }
 
+static void
+s_phase_top_create(s_phase_top_type* top, int size, int nrels)
+{
+	int i;
+
+	Assert(size > 0);
+	top->sequences = palloc(sizeof(RelOptInfo**) * size);
+	top->costs = palloc(sizeof(Cost) * size);
+	for( i=0; i<size; i++ )
+		top->sequences[i] = palloc(sizeof(RelOptInfo*) * nrels);
+	top->count = 0;
+	top->size = size;
+}
+
+static void
+s_phase_top_destroy(s_phase_top_type* top)
+{
+	int i;
+
+	for( i=0; i<top->size; i++ )
+		pfree(top->sequences[i]);
+	pfree(top->sequences);
+	pfree(top->costs);
+}
+
+/**
+ * s_phase_top_add:
+ *    Offers the sample *cur_rels with the given cost to "top". If the sample
+ *    is kept, its array is taken by "top" and *cur_rels receives a free one.
+ *    A sequence already in "top" is not added again: equal sequences build
+ *    equal plans, so only sequences with the same cost are compared.
+ */
+static void
+s_phase_top_add(s_phase_top_type* top, RelOptInfo*** cur_rels, Cost cost,
+		int nrels)
+{
+	RelOptInfo** spare;
+	int pos;
+	int i;
+
+	if( top->count == top->size && cost >= top->costs[top->count-1] )
+		return;
+
+	for( i=0; i<top->count && top->costs[i] <= cost; i++ )
+		if( top->costs[i] == cost && memcmp(top->sequences[i], *cur_rels,
+				sizeof(RelOptInfo*) * nrels) == 0 )
+			return;
+
+	if( top->count == top->size ) /* drop the most expensive one */
+		top->count--;
+	spare = top->sequences[top->count];
+
+	for( pos = top->count; pos > 0 && top->costs[pos-1] > cost; pos-- )
+	{
+		top->sequences[pos] = top->sequences[pos-1];
+		top->costs[pos] = top->costs[pos-1];
+	}
+	top->sequences[pos] = *cur_rels;
+	top->costs[pos] = cost;
+	top->count++;
+
+	SDP_DEBUG_MSG2("  s_phase_top_add(): cost=%lf, position=%d", cost, pos);
+
+	*cur_rels = spare;
+}
+
 /**
  * s_phase:
  *    Main function of S-Phase. This is a randomized algorithm which randomly
  *    generates a number of possible left-deep trees (samples) for the query
  *    based in its query-graph. This graph is represented by private_data->
- *    edge_list. The cost of each random sample is evaluated, and the cheapest
- *    one is elected for the next phase (DP-phase).
+ *    edge_list. The cost of each random sample is evaluated, and the
+ *    sdp_top_sequences cheapest distinct ones are elected for the next phase
+ *    (DP-phase).
  *
- *    The return of this function is a vector of RelOptInfo*, which consists
- *    on the join order of the cheapest generated sample.
+ *    The elected samples are returned in "top" (see s_phase_top_type).
  */
-static RelOptInfo**
-s_phase(private_data_type* private_data)
+static void
+s_phase(private_data_type* private_data, s_phase_top_type* top)
 {
 	int nrels = private_data->number_of_rels;
-	RelOptInfo**  ret = NULL;
 
 	SDP_DEBUG_MSG("> s_phase(private_data=%p)", private_data);
 	Assert(IsA(private_data->root, PlannerInfo)); /* sanity check */
@@ -699,11 +917,10 @@ s_phase(private_data_type* private_data)
 
 	{
 		temp_context_type save_context;
-		Cost          min_cost = 0;
-		RelOptInfo*   min_r;
-		RelOptInfo**  min_rels = palloc(sizeof(RelOptInfo*) * nrels);
 		RelOptInfo**  cur_rels = palloc(sizeof(RelOptInfo*) * nrels);
 		PlannerInfo*  root = private_data->root;
+		Cost          min_cost = 0;         /* see SDP_ADAPTIVE_EPSILON */
+		int           last_improvement = 0; /* samples up to the last one */
 		int           loop;
 		int           end_loop = nrels * sdp_iteration_slope
 		                       + sdp_iteration_const;
@@ -711,18 +928,43 @@ s_phase(private_data_type* private_data)
 		/* this array of List* isn't used by SDP */
 		Assert(root->join_rel_level == NULL);
 
+		/* the sequences are kept out of the temporary context */
+		s_phase_top_create(top, sdp_top_sequences, nrels);
+
 		/* creating a new memory context */
 		temporary_context_create(&save_context);
 		temporary_context_enter(&save_context);
 
+		/* memo of joins shared by the samples, freed with the context */
+		{
+			HASHCTL hash_ctl;
+
+			memset(&hash_ctl, 0, sizeof(hash_ctl));
+			hash_ctl.keysize = sizeof(sample_memo_key);
+			hash_ctl.entrysize = sizeof(sample_memo_entry);
+			hash_ctl.hash = tag_hash;
+			hash_ctl.hcxt = CurrentMemoryContext;
+			private_data->sample_memo = hash_create("SDP S-phase joins",
+					nrels * 64, &hash_ctl,
+					HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+			private_data->sample_joins_built = 0;
+			private_data->sample_joins_reused = 0;
+		}
+
 		/* set the number of samples generated in this phase */
 		if( end_loop < sdp_min_iterations )
 			end_loop = sdp_min_iterations;
 		else if( end_loop > sdp_max_iterations )
 			end_loop = sdp_max_iterations;
 
+		/* adaptive stop: sampling may go up to twice end_loop while the
+		 * minimum cost keeps improving, or stop earlier when it does not */
+		if( sdp_adaptive_stop > 0 )
+			end_loop = (end_loop > sdp_max_iterations / 2)
+			           ? sdp_max_iterations : end_loop * 2;
+
 		/* S-phase's main loop:
-		 *    Get end_loop samples from the query and elect the one with
+		 *    Get end_loop samples from the query and elect the ones with
 		 *    cheapest cost */
 		for( loop=0; loop < end_loop; loop++ )
 		{
@@ -730,16 +972,36 @@ s_phase(private_data_type* private_data)
 			sample_return_type*  returned_item;
 			RelOptInfo*          cur_rel;
 
+			/* out of time: keep the cheapest sample found so far */
+			if( loop && ljqo_time_budget_exhausted() )
+			{
+				SDP_DEBUG_MSG("  s_phase(): time budget exhausted, loop=%d",
+						loop);
+				break;
+			}
+
+			/* no improvement in the last sdp_adaptive_stop% of the samples */
+			if( sdp_adaptive_stop > 0 && loop >= sdp_min_iterations
+			    && (double) (loop - last_improvement) * 100.0
+			       >= (double) loop * sdp_adaptive_stop )
+			{
+				SDP_DEBUG_MSG("  s_phase(): converged, loop=%d, "
+						"last_improvement=%d", loop, last_improvement);
+				break;
+			}
+
 			SDP_DEBUG_MSG2_SS("  s_phase(): loop=%d", loop);
 
-			/* root->join_rel_list must be cleaned before a new sample. */
+			/* root->join_rel_list must be cleaned before a new sample, so
+			 * joins not found in sample_memo get new RelOptInfos instead of
+			 * adding paths to the ones of other samples. */
 			/* It's also expected that root->join_rel_hash = NULL. */
 			clear_root_join_rel(&private_data->save_root_join_rel, root);
 
 			/* get a new sample:
 			 *   returned_list and cur_rels are outputs from the function call */
 			returned_list = s_phase_get_a_sample(&private_data->edge_list,
-					cur_rels, root, nrels);
+					cur_rels, nrels, private_data);
 
 			/* it's expected only one returned_item* in returned_list */
 			Assert(list_length(returned_list) == 1);
@@ -752,42 +1014,41 @@ s_phase(private_data_type* private_data)
 
 			OPTE_CONVERG( private_data->opte, cheapest_total(cur_rel) );
 
-			if( !min_cost ||
-				 min_cost > cheapest_total(cur_rel))
-			{
-				/* swap cur_rels <--> min_rels */
-				RelOptInfo** aux = cur_rels;
-				cur_rels = min_rels;
-				min_rels = aux;
-
-				SDP_DEBUG_MSG2("  s_phase(): loop=%d, min_cost=%lf --> %lf",
-						loop, min_cost, cheapest_total(cur_rel));
+			s_phase_top_add(top, &cur_rels, cheapest_total(cur_rel), nrels);
 
-				min_r = cur_rel;
-				min_cost = cheapest_total(cur_rel);
+			if( !min_cost
+			    || top->costs[0] < min_cost * (1.0 - SDP_ADAPTIVE_EPSILON) )
+			{
+				min_cost = top->costs[0];
+				last_improvement = loop +1;
 			}
 		} /* end for(loop) */
 
-		if( min_cost == 0 )
+		if( top->count == 0 )
 			elog(ERROR, "SDP: S-phase could not get any valid sample "
 			            "for the query");
 
-		SDP_DEBUG_MSG("  s_phase(): min_cost=%lf", min_cost);
-		opte_printf("Phase1 Cost = %.2lf", min_cost);
+		SDP_DEBUG_MSG("  s_phase(): min_cost=%lf", top->costs[0]);
+		opte_printf("Phase1 Cost = %.2lf", top->costs[0]);
+		opte_printf("Phase1 Samples = %d", loop);
+		opte_printf("Phase1 Joins = %d built, %d reused",
+				private_data->sample_joins_built,
+				private_data->sample_joins_reused);
 
 		/* restore old memory context */
 		temporary_context_leave(&save_context);
 		restore_root_join_rel(&private_data->save_root_join_rel, root);
 		temporary_context_destroy(&save_context);
+		private_data->sample_memo = NULL;
 
 #		ifdef USE_ASSERT_CHECKING
 		{
 			int i;
 			for( i=0; i<nrels; i++ )
 			{
-				Assert(IsA(min_rels[i], RelOptInfo));
+				Assert(IsA(top->sequences[0][i], RelOptInfo));
 				SDP_DEBUG_MSG2("  s_phase(): min_rels[%d] = %u",
-						i, min_rels[i]->relid);
+						i, top->sequences[0][i]->relid);
 			}
 		}
 #		endif
@@ -795,14 +1056,10 @@ s_phase(private_data_type* private_data)
 		/* we don't need this array any more */
 		pfree(cur_rels);
 		/* this cost permits a comparison between s-phase and dp-phase */
-		private_data->s_phase_rel_cost = min_cost;
-		/* min_rels array need to be returned by this function */
-		ret = min_rels;
+		private_data->s_phase_rel_cost = top->costs[0];
 	}
 
-	Assert(ret);
 	SDP_DEBUG_MSG("< s_phase()");
-	return ret;
 }
 
 /*===========================================================================*/
@@ -820,6 +1077,12 @@ s_phase(private_data_type* private_data)
  *    find the best way to put parenthesis on these relations, e.g.
  *             (A Join B) Join C ... or A Join (B Join C) ...
  *
+ *    With sdp_dp_window = w (0 = no window), only subsequences of at most w
+ *    relations are optimized by DP (matrix). The complete plan is then
+ *    chained left-deep over these windows: the plan for the first k+1
+ *    relations of the sequence joins the plan for a prefix with a window
+ *    that ends at k. This takes O(n*w^2) joins instead of O(n^3).
+ *
  *    The return of this function is the result of SDP optimization process.
  */
 static RelOptInfo*
@@ -828,8 +1091,10 @@ dp_phase(private_data_type *private_data, RelOptInfo **sequence)
 	RelOptInfo* ret; /*return*/
 	PlannerInfo* root = private_data->root;
 	int nrels = private_data->number_of_rels;
+	int window = nrels;
 	int level;
-	RelOptInfo*** matrix = palloc(sizeof(RelOptInfo**) * nrels);
+	RelOptInfo*** matrix;
+	RelOptInfo** chain; /* chain[k]: plan for sequence[0..k] */
 
 	SDP_DEBUG_MSG("> dp_phase(private_data=%p, sequence=%p)",
 			private_data, sequence);
@@ -837,14 +1102,19 @@ dp_phase(private_data_type *private_data, RelOptInfo **sequence)
 	Assert(sequence);
 	Assert(nrels > 1);
 
-	for( level = 0; level < nrels; level++ )
+	if( sdp_dp_window > 0 && sdp_dp_window < nrels )
+		window = sdp_dp_window;
+	matrix = palloc(sizeof(RelOptInfo**) * window);
+
+	/* DP over the subsequences with up to "window" relations */
+	for( level = 0; level < window; level++ )
 	{
 		int p;
 
 		SDP_DEBUG_MSG2_DP("  dp_phase(): level=%d", level);
 
 		if( level > 0 )
-			matrix[level] = palloc(sizeof(RelOptInfo*) * nrels -level);
+			matrix[level] = palloc(sizeof(RelOptInfo*) * (nrels -level));
 		else
 		{
 			matrix[level] = sequence;
@@ -901,20 +1171,64 @@ dp_phase(private_data_type *private_data, RelOptInfo **sequence)
 
 	}
 
-	if( !matrix[nrels-1][0] )
+	/* chaining the windows */
+	chain = palloc(sizeof(RelOptInfo*) * nrels);
+	for( level = 0; level < nrels; level++ )
+	{
+		int len;
+
+		if( level < window )
+		{
+			chain[level] = matrix[level][0];
+			continue;
+		}
+
+		chain[level] = NULL;
+		root->join_cur_level = level +1;
+
+		/* last window: sequence[level-len+1 .. level] */
+		for( len = 1; len <= window; len++ )
+		{
+			RelOptInfo* rel1 = chain[level-len];
+			RelOptInfo* rel2 = matrix[len-1][level-len+1];
+
+			if( rel1 && rel2 )
+			{
+				RelOptInfo *join;
+				Assert(!bms_overlap(rel1->relids, rel2->relids));
+
+				join = make_join_rel(root, rel1, rel2);
+				if( join )
+				{
+					Assert(!chain[level] || chain[level] == join);
+					chain[level] = join;
+				}
+			}
+		}
+
+		if( chain[level] )
+		{
+			set_cheapest(chain[level]);
+			SDP_DEBUG_MSG2_DP("  dp_phase(): chain[%d] = %lf",
+					level, cheapest_total(chain[level]));
+		}
+	}
+
+	if( !chain[nrels-1] )
 		elog(ERROR, "SDP: DP-phase could not generate any complete plan for"
 		            "the query");
 
-	Assert(IsA(matrix[nrels-1][0], RelOptInfo));
-	ret = matrix[nrels-1][0];
+	Assert(IsA(chain[nrels-1], RelOptInfo));
+	ret = chain[nrels-1];
 
 	Assert(ret->cheapest_total_path);
 	SDP_DEBUG_MSG("  dp_phase(): best plan found! cost=%lf",
 			cheapest_total(ret));
 
-	for( level = 1; level < nrels; level++ ) /* do not free level=0 here */
+	for( level = 1; level < window; level++ ) /* do not free level=0 here */
 		pfree(matrix[level]);
 	pfree(matrix);
+	pfree(chain);
 
 	SDP_DEBUG_MSG("< dp_phase()");
 	return ret;
@@ -33,7 +33,14 @@ show_sdp_about(void)
 	"  sdp_iteration_factor = Int   - factor that defines the number of \n"
 	"                                 iterations performed by S-Phase\n"
 	"    sdp_min_iterations = Int   - Minimum number of iterations in S-Phase\n"
-	"    sdp_max_iterations = Int   - Maximum number of iterations in S-Phase"
+	"    sdp_max_iterations = Int   - Maximum number of iterations in S-Phase\n"
+	"         sdp_dp_window = Int   - Maximum number of relations optimized\n"
+	"                                 together by DP-Phase (0 = all)\n"
+	"     sdp_top_sequences = Int   - Number of the cheapest S-Phase samples\n"
+	"                                 optimized by DP-Phase\n"
+	"     sdp_adaptive_stop = Int   - Stops S-Phase when the last Int% of the\n"
+	"                                 samples did not improve the cheapest one\n"
+	"                                 (0 = fixed number of samples)"
 	;
 }
 
@@ -98,4 +105,43 @@ sdp_register(void)
 			NULL,
 			NULL,
 			NULL);
+	DefineCustomIntVariable("sdp_dp_window",
+			"DP-Phase window",
+			"Maximum number of relations optimized together by DP-Phase "
+			"(0 = all)",
+			&sdp_dp_window,
+			DEFAULT_SDP_DP_WINDOW,
+			MIN_SDP_DP_WINDOW,
+			MAX_SDP_DP_WINDOW,
+			PGC_USERSET,
+			0,
+			NULL,
+			NULL,
+			NULL);
+	DefineCustomIntVariable("sdp_top_sequences",
+			"Top S-Phase sequences",
+			"Number of the cheapest distinct S-Phase samples optimized "
+			"by DP-Phase",
+			&sdp_top_sequences,
+			DEFAULT_SDP_TOP_SEQUENCES,
+			MIN_SDP_TOP_SEQUENCES,
+			MAX_SDP_TOP_SEQUENCES,
+			PGC_USERSET,
+			0,
+			NULL,
+			NULL,
+			NULL);
+	DefineCustomIntVariable("sdp_adaptive_stop",
+			"S-Phase adaptive stop",
+			"Stops S-Phase when the last N% of the samples did not improve "
+			"the cheapest one (0 = fixed number of samples)",
+			&sdp_adaptive_stop,
+			DEFAULT_SDP_ADAPTIVE_STOP,
+			MIN_SDP_ADAPTIVE_STOP,
+			MAX_SDP_ADAPTIVE_STOP,
+			PGC_USERSET,
+			0,
+			NULL,
+			NULL,
+			NULL);
 }
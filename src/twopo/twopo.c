@@ -45,12 +45,20 @@
 #include <math.h>
 #include <optimizer/paths.h>
 #include <utils/memutils.h>
+#include <utils/hsearch.h>
 #include "twopo_list.h"
+#include "ljqo_random.h"
+#include "ljqo_time_budget.h"
+#include "ljqo_graph.h"
+#include "ljqo_paths.h"
+#include "ljqo_cache.h"
 #include "opte.h"
 
 //#define TWOPO_DEBUG
 
 #define COST_UNGENERATED 0
+#define COST_REJECTED    -1  // plan construction stopped by a cost bound
+#define NO_COST_BOUND    0
 #define nodeCost(node) node->rel->cheapest_total_path->total_cost
 
 #define swapValues(type,v1,v2) \
@@ -62,6 +70,17 @@
 
 #define XOR(a,b) (a || b) && !(a && b)
 
+/*
+ * Sets of base relations (indexes of nodeList) are stored as arrays of
+ * essentials->maskWords words.
+ */
+#define MASK_WORD_BITS 64
+#define maskWordsFor(n) (((n) + MASK_WORD_BITS -1) / MASK_WORD_BITS)
+#define maskSet(mask,i) \
+	((mask)[(i) / MASK_WORD_BITS] |= ((uint64) 1) << ((i) % MASK_WORD_BITS))
+#define maskIsSet(mask,i) \
+	(((mask)[(i) / MASK_WORD_BITS] >> ((i) % MASK_WORD_BITS)) & 1)
+
 // defines if twopo will search plans in edgeList or nodeList
 bool   twopo_bushy_space               = DEFAULT_TWOPO_BUSHY_SPACE;
 // heuristic initial states (see makeInitialState())
@@ -78,6 +97,16 @@ double twopo_sa_initial_temperature    = DEFAULT_TWOPO_SA_INITIAL_TEMPERATURE;
 double twopo_sa_temperature_reduction  = DEFAULT_TWOPO_SA_TEMPERATURE_REDUCTION;
 // SA inner loop equilibrium: for( i=0; i < E * Joins ; i++ )
 int    twopo_sa_equilibrium            = DEFAULT_TWOPO_SA_EQUILIBRIUM;
+// stop building II neighbors costlier than the local minimum (heuristic)
+bool   twopo_ii_cutoff                 = DEFAULT_TWOPO_II_CUTOFF;
+// entries of the visited-state memo (0 disables it)
+int    twopo_state_memo_size           = DEFAULT_TWOPO_STATE_MEMO_SIZE;
+// search with estimated join sizes, building paths only for the finalists
+bool   twopo_rows_only                 = DEFAULT_TWOPO_ROWS_ONLY;
+// number of states planned with make_join_rel() in rows-only mode
+int    twopo_finalists                 = DEFAULT_TWOPO_FINALISTS;
+// join problems whose search is continued by their next plan (0 disables it)
+int    twopo_refine_size               = DEFAULT_TWOPO_REFINE_SIZE;
 #ifdef TWOPO_CACHE_PLANS
 // uses cache structure for to minimize optimization time (more memory)
 bool   twopo_cache_plans               = DEFAULT_TWOPO_CACHE_PLANS;
@@ -95,12 +124,73 @@ int    twopo_cache_size                = DEFAULT_TWOPO_CACHE_SIZE;
 typedef struct treeNode {
 	RelOptInfo         *rel;
 #	ifdef TWOPO_CACHE_PLANS
-	List               *parents;
 	struct treeNode    *inner_child;
 	struct treeNode    *outer_child;
 #	endif
 } treeNode;
 
+#ifdef TWOPO_CACHE_PLANS
+/**
+ * joinCacheKey:
+ *    Key of the join cache: the pair of joined treeNodes. The pair is
+ *    ordered by address, so (A,B) and (B,A) find the same entry.
+ */
+typedef struct joinCacheKey {
+	treeNode           *child[2];
+} joinCacheKey;
+
+typedef struct joinCacheEntry {
+	joinCacheKey        key;      // must be the first field
+	treeNode           *node;
+} joinCacheEntry;
+#endif
+
+/**
+ * stateMemoEntry:
+ *    Entry of the visited-state memo (see evaluateState()). A fingerprint
+ *    of 0 marks an empty entry. A hit needs both the fingerprint and the
+ *    second hash "check" to match, so a collision of fingerprints does not
+ *    return the cost of another state.
+ */
+typedef struct stateMemoEntry {
+	uint64              fingerprint;
+	uint64              check;
+	Cost                cost;
+} stateMemoEntry;
+
+// seed of the second hash of a state (see stateHash())
+#define STATE_CHECK_SEED UINT64CONST(0xD6E8FEB86659FD93)
+
+// slots probed from the home slot of a fingerprint before overwriting it
+#define STATE_MEMO_PROBES 8
+
+/**
+ * refineEntry:
+ *    Search of a join problem that is continued when the problem is
+ *    planned again (see twopo_refine_size). The key is the shape
+ *    fingerprint of the problem (ljqo_cache.h), so the statement keeps its
+ *    entry when the row estimates change with its parameters. The shape
+ *    includes the special joins, so the resumed state is as legal for the
+ *    new problem as it was for the old one.
+ */
+typedef struct refineEntry {
+	uint64              fingerprint;   // must be the first field
+	uint32             *words;         // shape of the problem
+	int                 nwords;
+	int                 type;          // StateType of elementList
+	int                 size;
+	union Element      *elementList;   // best state found so far
+	double              temperature;   // SA temperature reached, relative
+	                                   // to the cost of the best state
+	int                 stageCount;    // SA stages without improvement
+	int                 runs;          // searches continued from the entry
+	uint64              lastUsed;      // value of refineClock
+} refineEntry;
+
+static MemoryContext refineContext = NULL;
+static HTAB         *refineTable   = NULL;
+static uint64        refineClock   = 0;
+
 /**
  * tempCtx:
  *    Temporary memory context struct.
@@ -118,6 +208,12 @@ typedef struct Edge {
 	int node[2];
 } Edge;
 
+// equivalence class that joins the relations of an edge (rows-only)
+typedef struct EdgeClass {
+	int         ec;   // position in root->eq_classes
+	Selectivity sel;  // selectivity of its clause for the edge
+} EdgeClass;
+
 /**
  * twopoEssentials:
  */
@@ -127,13 +223,51 @@ typedef struct twopoEssentials {
 	int          numNodes;  // number of initial rels
 	Edge        *edgeList;
 	int          numEdges;
-	bool       **adj;       // adjacency matrix
+	uint64      *adj;       // adjacency matrix, maskWords words per node
+	int          maskWords; // words of a relation mask (see maskSet())
 	// Temporary Memory Context
 	tempCtx     *ctx;
+	// private random number generator of this optimization
+	ljqo_random_state random;
+	// incremented whenever treeNodes of the temporary context are freed
+	unsigned int generation;
+	// costs of visited states (NULL if disabled), stateMemoMask+1 entries
+	stateMemoEntry *stateMemo;
+	uint64       stateMemoMask;
+	// rows-only evaluation (see estimateState()): states are compared by
+	// estimated join sizes and only the finalists are planned in full
+	bool         rowsOnly;
+	ljqo_graph  *graph;     // join edges, NULL if rowsOnly is false
+	Selectivity *selValue;  // selectivity of each edge of graph->adj,
+	                        // without the clauses of equivalence classes
+	int         *ecFirst;   // equivalence classes of each edge of graph->adj:
+	int         *ecCount;   // ecItems[ecFirst[k] .. ecFirst[k]+ecCount[k]-1]
+	EdgeClass   *ecItems;
+	uint64      *ecSeen;    // classes already counted by crossSelectivity()
+	int          ecWords;   // words of ecSeen
+	uint64      *scratchMasks; // two relation masks used by estimates
+	struct State **finalists; // twopo_finalists cheapest distinct states
+	uint64      *finalistPrints; // their fingerprints
+	int          numFinalists;
+#	ifdef TWOPO_CACHE_PLANS
+	// join cache (joinCacheEntry), allocated in the temporary context
+	HTAB        *joinCache;
+	// estimated bytes used by cached nodes (see contextSizeIsExcedded())
+	Size         cacheBytes;
+	// estimated bytes of the live states rebuilt by the last eviction
+	Size         liveBytes;
+	// states whose nodes survive a cache eviction (see evictCache())
+	struct State *curState;
+	struct State *bestState;
+#	endif
 #	if ENABLE_OPTE
 	OPTE_DECLARE( *opte );
 	int          opteCreatedNodes;
 	int          opteReusedNodes;
+	int          opteCacheEvictions;
+	int          opteCutoffStates;
+	int          opteMemoLookups;
+	int          opteMemoHits;
 #	endif
 } twopoEssentials;
 
@@ -177,8 +311,34 @@ typedef struct State {
 	                               // (plano)
 	int              size;         // Tamanho do estado (elementList)
 	Cost             cost;         // Custo estimado do plano
+	treeNode       **nodes;        // treeNode built for each element; NULL
+	                               // means it must be rebuilt (see buildTree())
+	int             *parents;      // bushy only: parent join of each element
+	uint64          *relMasks;     // bushy only: base relations of each join
+	                               // (essentials->maskWords per element)
+	unsigned int     generation;   // essentials->generation of "nodes"
 } State;
 
+/**
+ * Move:
+ *   Undo record of a neighbor move. Moves are applied in place on the
+ *   current state (see neighbordState()) and reverted by undoMove() when
+ *   the new state is rejected.
+ */
+typedef struct Move {
+	bool             applied;      // false if no valid move was found
+	int             *slot[3];      // modified positions of elementList
+	int              oldValue[3];
+	int              numSlots;
+	int              fatherIdx;    // bushy: element whose children changed
+	int              joinIdx;      // bushy: parent of fatherIdx
+	int             *nodeIdx;      // invalidated nodes and their old values
+	treeNode       **nodeVal;
+	int              numNodes;
+	Cost             cost;         // state->cost before the move
+	unsigned int     generation;   // state->generation before the move
+} Move;
+
 /**
  * HeuristicStruct:
  *    Estrutura usada para a construção de planos heurísticos baseados nas
@@ -233,10 +393,6 @@ createTemporaryContext( twopoEssentials *essentials )
 static void
 resetTemporaryContext( twopoEssentials *essentials )
 {
-#	ifdef TWOPO_CACHE_PLANS
-	int i;
-#	endif
-
 	Assert( essentials != NULL );
 
 	if ( ! essentials->ctx )
@@ -255,15 +411,15 @@ resetTemporaryContext( twopoEssentials *essentials )
 		list_truncate(essentials->root->join_rel_list,
 			essentials->ctx->savelength);
 	essentials->root->join_rel_hash = NULL;
+	essentials->generation++;
 
 #	ifdef TWOPO_CACHE_PLANS
 	/*
-	 * Cleaning parent nodes in nodeList deleted by
-	 * MemoryContextResetAndDeleteChildren()
+	 * Join cache is deleted by MemoryContextResetAndDeleteChildren()
 	 */
-	for( i=0; i<essentials->numNodes; i++ ){
-		essentials->nodeList[i].parents = NULL;
-	}
+	essentials->joinCache = NULL;
+	essentials->cacheBytes = 0;
+	essentials->liveBytes = 0;
 #	endif
 
 	MemoryContextResetAndDeleteChildren(essentials->ctx->mycontext);
@@ -272,10 +428,6 @@ resetTemporaryContext( twopoEssentials *essentials )
 static void
 restoreOldContext( twopoEssentials *essentials )
 {
-#	ifdef TWOPO_CACHE_PLANS
-	int i;
-#	endif
-
 	Assert( essentials != NULL );
 
 	if ( ! essentials->ctx )
@@ -295,14 +447,15 @@ restoreOldContext( twopoEssentials *essentials )
 
 	pfree(essentials->ctx);
 	essentials->ctx = NULL;
+	essentials->generation++;
 
 #	ifdef TWOPO_CACHE_PLANS
 	/*
-	 * Cleaning parent nodes in nodeList deleted by MemoryContextDelete()
+	 * Join cache is deleted by MemoryContextDelete()
 	 */
-	for( i=0; i<essentials->numNodes; i++ ){
-		essentials->nodeList[i].parents = NULL;
-	}
+	essentials->joinCache = NULL;
+	essentials->cacheBytes = 0;
+	essentials->liveBytes = 0;
 #	endif
 }
 
@@ -320,19 +473,30 @@ safeContextAlloc(twopoEssentials *essentials, size_t size)
 }
 
 #ifdef TWOPO_CACHE_PLANS
+/**
+ * contextSizeIsExcedded:
+ *    Compares the estimated size of the cached nodes with twopo_cache_size.
+ *    The estimate is updated by joinNodes() for each created node (see
+ *    estimateNodeSpace()), so this check does not walk the memory context
+ *    (PostgreSQL has no cheap way to measure it) and the limit is only
+ *    approximate.
+ *
+ *    After an eviction, the cache may grow by at least half of the limit
+ *    beyond the rebuilt live states, so that large live states do not make
+ *    every build evict the cache again.
+ */
 static bool
 contextSizeIsExcedded( twopoEssentials *essentials )
 {
-	memStats stats;
+	Size limit = (Size) twopo_cache_size * 1024;
 
 	Assert( essentials != NULL );
 
 	if ( ! essentials->ctx )
 		return false;
 
-	getMemoryContextStats( essentials->ctx->mycontext, &stats );
-
-	return (stats.used >= (twopo_cache_size * 1024));
+	return (essentials->cacheBytes >=
+			Max(limit, essentials->liveBytes + limit / 2));
 }
 #endif
 
@@ -368,6 +532,20 @@ createState(twopoEssentials *essentials, StateType type)
 	result->essentials = essentials;
 	result->cost = COST_UNGENERATED;
 
+	result->nodes = (treeNode**)safeContextAlloc(essentials,
+			sizeof(treeNode*) * result->size);
+	memset(result->nodes, 0, sizeof(treeNode*) * result->size);
+	if( type == stBushy ) {
+		result->parents = (int*)safeContextAlloc(essentials,
+				sizeof(int) * result->size);
+		result->relMasks = (uint64*)safeContextAlloc(essentials,
+				sizeof(uint64) * essentials->maskWords * result->size);
+	} else {
+		result->parents = NULL;
+		result->relMasks = NULL;
+	}
+	result->generation = essentials->generation;
+
 	return result;
 }
 
@@ -383,6 +561,12 @@ destroyState(State *state)
 	if( state->elementList ){
 		pfree(state->elementList);
 	}
+	if( state->nodes )
+		pfree(state->nodes);
+	if( state->parents )
+		pfree(state->parents);
+	if( state->relMasks )
+		pfree(state->relMasks);
 
 	pfree(state);
 }
@@ -414,10 +598,66 @@ copyState(State *output, State *input)
 
 	memcpy(output->elementList, input->elementList,
 			sizeof(Element) * input->size);
+	memcpy(output->nodes, input->nodes,
+			sizeof(treeNode*) * input->size);
+	if( input->parents )
+		memcpy(output->parents, input->parents,
+				sizeof(int) * input->size);
+	if( input->relMasks )
+		memcpy(output->relMasks, input->relMasks,
+				sizeof(uint64) * input->essentials->maskWords * input->size);
+	output->generation = input->generation;
 
 	return output;
 }
 
+/**
+ * resetStateNodes:
+ *   Forgets all treeNodes of the state. Used when its elementList is
+ *   completely rewritten.
+ */
+static void
+resetStateNodes(State *state)
+{
+	Assert( state != NULL );
+
+	memset(state->nodes, 0, sizeof(treeNode*) * state->size);
+}
+
+/**
+ * invalidateStateNodes:
+ *   Marks the element "idx" as modified. Only the path from this element
+ *   to the root of the plan is rebuilt by the next buildTree(); all other
+ *   treeNodes are reused.
+ *
+ *   Left-deep: every prefix from position "idx" on is invalid.
+ *   Bushy:     "idx" and all its ancestors are invalid.
+ *
+ *   A NULL node implies that all nodes above it are also NULL, so the walk
+ *   stops at the first NULL entry. Removed nodes are saved in "move".
+ */
+static void
+invalidateStateNodes(State *state, int idx, Move *move)
+{
+	Assert( state != NULL );
+	Assert( move != NULL );
+	Assert( idx >= 0 && idx < state->size );
+
+	while( idx >= 0 && idx < state->size && state->nodes[idx] ){
+		Assert( move->numNodes < state->size );
+		move->nodeIdx[move->numNodes] = idx;
+		move->nodeVal[move->numNodes] = state->nodes[idx];
+		move->numNodes++;
+
+		state->nodes[idx] = NULL;
+
+		if( state->type == stBushy )
+			idx = state->parents[idx];
+		else
+			idx++;
+	}
+}
+
 /**
  * convertIndex:
  *   f(x) = -x -1
@@ -446,6 +686,76 @@ isJoinIndex(int index)
 	return index < 0;
 }
 
+static inline bool
+isAdjacent(twopoEssentials *essentials, int rel1, int rel2)
+{
+	return maskIsSet(&(essentials->adj[rel1 * essentials->maskWords]), rel2);
+}
+
+/**
+ * lowestBit:
+ *   Position of the lowest bit set in a non-zero word.
+ */
+static inline int
+lowestBit(uint64 word)
+{
+	Assert( word != 0 );
+#	ifdef __GNUC__
+	return __builtin_ctzll(word);
+#	else
+	{
+		int pos = 0;
+		while( !(word & 1) ){
+			word >>= 1;
+			pos++;
+		}
+		return pos;
+	}
+#	endif
+}
+
+/**
+ * elementRelMask:
+ *   Base relations of the join element "idx" of a bushy state.
+ */
+static inline uint64 *
+elementRelMask(State *state, int idx)
+{
+	Assert( state->type == stBushy );
+	Assert( idx >= 0 && idx < state->size );
+	return &(state->relMasks[idx * state->essentials->maskWords]);
+}
+
+/**
+ * buildRelMasks:
+ *   Computes the masks of base relations of the element "idx" and of all
+ *   joins below it.
+ */
+static void
+buildRelMasks(State *state, int idx)
+{
+	int     i, w;
+	int     words = state->essentials->maskWords;
+	uint64 *mask  = elementRelMask(state, idx);
+
+	memset(mask, 0, sizeof(uint64) * words);
+
+	for( i=0; i<2; i++ ){
+		int child = state->elementList[idx].child[i];
+
+		if( isJoinIndex(child) ) {
+			uint64 *childMask;
+
+			buildRelMasks(state, convertIndex(child));
+			childMask = elementRelMask(state, convertIndex(child));
+			for( w=0; w<words; w++ )
+				mask[w] |= childMask[w];
+		} else {
+			maskSet(mask, child);
+		}
+	}
+}
+
 /**
  * join_trees:
  *    Parte do algoritmo de Kruskal.
@@ -616,6 +926,89 @@ encodeLeftDeepTree(Element *elementList/*OUT*/,
 //////////////////////////////////////////////////////////////////////////////
 /////////////////////////// Join Function ////////////////////////////////////
 
+#ifdef TWOPO_CACHE_PLANS
+/*
+ * Memory of a join node that estimateNodeSpace() does not count: the
+ * restriction and target lists of the join rel, the join clauses, pathkeys
+ * and param infos of its paths, and the overhead of the allocator. It is
+ * accounted for by scaling the counted size, so twopo_cache_size is an
+ * approximate limit.
+ */
+#define NODE_SPACE_FACTOR 3
+
+/**
+ * estimateNodeSpace:
+ *    Approximate memory used by a new join node: the treeNode, its
+ *    RelOptInfo, the paths kept by add_path() and the cache entry, scaled
+ *    by NODE_SPACE_FACTOR.
+ */
+static Size
+estimateNodeSpace( treeNode *node )
+{
+	Size      size;
+	ListCell *x;
+
+	Assert( node != NULL );
+	Assert( node->rel != NULL );
+
+	size = GetMemoryChunkSpace(node)
+	     + GetMemoryChunkSpace(node->rel)
+	     + sizeof(joinCacheEntry);
+	foreach( x, node->rel->pathlist )
+		size += GetMemoryChunkSpace(lfirst(x)) + sizeof(ListCell);
+
+	return size * NODE_SPACE_FACTOR;
+}
+
+/**
+ * joinCacheLookup:
+ *    Returns the cache entry of the join between node1 and node2, creating
+ *    an empty one (entry->node == NULL) if it does not exist.
+ *
+ *    The cache lives in the temporary memory context and is created on
+ *    demand after each reset of that context.
+ */
+static joinCacheEntry *
+joinCacheLookup( twopoEssentials *essentials,
+		treeNode *node1, treeNode *node2 )
+{
+	joinCacheKey    key;
+	joinCacheEntry *entry;
+	bool            found;
+
+	Assert( essentials != NULL );
+	Assert( essentials->ctx != NULL );
+
+	if( !essentials->joinCache ) {
+		HASHCTL ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(joinCacheKey);
+		ctl.entrysize = sizeof(joinCacheEntry);
+		ctl.hash = tag_hash;
+		ctl.hcxt = essentials->ctx->mycontext;
+		essentials->joinCache = hash_create("TwoPO join cache",
+				256L, &ctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	}
+
+	memset(&key, 0, sizeof(key));
+	if( node1 < node2 ) {
+		key.child[0] = node1;
+		key.child[1] = node2;
+	} else {
+		key.child[0] = node2;
+		key.child[1] = node1;
+	}
+
+	entry = (joinCacheEntry*) hash_search(essentials->joinCache, &key,
+			HASH_ENTER, &found);
+	if( !found )
+		entry->node = NULL;
+
+	return entry;
+}
+#endif
+
 /**
  * joinNodes:
  *    Realiza a junção de dois treeNode's e retorna o treeNode resultante.
@@ -624,8 +1017,12 @@ static treeNode*
 joinNodes( twopoEssentials *essentials,
 		treeNode *inner_node, treeNode *outer_node )
 {
-	treeNode    *new_node = NULL;
-	RelOptInfo  *jrel;
+	treeNode       *new_node = NULL;
+	RelOptInfo     *jrel;
+	int             numJoinRels;
+#	ifdef TWOPO_CACHE_PLANS
+	joinCacheEntry *entry = NULL;
+#	endif
 
 	Assert( essentials != NULL );
 	Assert( inner_node != NULL );
@@ -633,26 +1030,18 @@ joinNodes( twopoEssentials *essentials,
 	Assert(!bms_overlap(inner_node->rel->relids,outer_node->rel->relids));
 
 #	ifdef TWOPO_CACHE_PLANS
-	if ( inner_node->parents ) {
-		ListCell *x;
-		treeNode *node;
-		foreach( x, inner_node->parents )
-		{
-			node = lfirst(x);
-			if( node->inner_child == outer_node
-			 || node->outer_child == outer_node )
-			{
-				new_node = node;
-#				if ENABLE_OPTE
-				essentials->opteReusedNodes++;
-#				endif
-				break;
-			}
-		}
+	if ( twopo_cache_plans && essentials->ctx ) {
+		entry = joinCacheLookup(essentials, inner_node, outer_node);
+		new_node = entry->node;
+#		if ENABLE_OPTE
+		if ( new_node )
+			essentials->opteReusedNodes++;
+#		endif
 	}
 
 	if ( ! new_node ) {
 #	endif
+		numJoinRels = list_length(essentials->root->join_rel_list);
 		jrel = make_join_rel(essentials->root, inner_node->rel,
 				outer_node->rel);
 		if (jrel) {
@@ -660,16 +1049,18 @@ joinNodes( twopoEssentials *essentials,
 			essentials->opteCreatedNodes++;
 #			endif
 			set_cheapest( jrel );
+			// only the final plan is built out of the temporary context
+			if( essentials->ctx )
+				ljqo_reduce_paths(jrel, list_length(
+						essentials->root->join_rel_list) > numJoinRels);
 			new_node = (treeNode*)palloc0(sizeof(treeNode));
 			new_node->rel = jrel;
 #			ifdef TWOPO_CACHE_PLANS
 			new_node->inner_child = inner_node;
 			new_node->outer_child = outer_node;
-			if ( twopo_cache_plans ) {
-				inner_node->parents = lcons(new_node,
-						inner_node->parents);
-				outer_node->parents = lcons(new_node,
-						outer_node->parents);
+			if ( entry ) {
+				entry->node = new_node;
+				essentials->cacheBytes += estimateNodeSpace(new_node);
 			}
 #			endif
 		}
@@ -686,14 +1077,31 @@ joinNodes( twopoEssentials *essentials,
 ////////////////////// Building Join Trees from states ///////////////////////
 
 /**
- * buildBushyTree:
+ * exceedsBound:
+ *    Verifies whether a partial plan is already as expensive as "bound".
+ *    This is a heuristic, not a safe bound: the cost of a join does not
+ *    always include the cost of its inputs (a merge join charges only the
+ *    fraction of the input scanned, as given by mergejoinscansel(), and a
+ *    parameterized inner path is cheaper than the cheapest_total_path of
+ *    the input), so a rejected plan may lead to a cheaper complete plan.
+ */
+static inline bool
+exceedsBound(treeNode *node, Cost bound)
+{
+	return bound != NO_COST_BOUND && nodeCost(node) >= bound;
+}
+
+/**
+ * joinSubplans:
+ *    Returns the treeNode of "joinIndex", building only the subtrees whose
+ *    nodes are not valid in state->nodes.
+ *    Returns NULL if any subtree exceeds "bound" (see exceedsBound()).
  */
 static treeNode*
-joinSubplans(State *state, treeNode **subplans, int joinIndex)
+joinSubplans(State *state, int joinIndex, Cost bound)
 {
 	Assert( state != NULL );
 	Assert( state->type == stBushy );
-	Assert( subplans != NULL );
 
 	if( !isJoinIndex(joinIndex) ) {
 		Assert( joinIndex < state->essentials->numNodes );
@@ -701,45 +1109,64 @@ joinSubplans(State *state, treeNode **subplans, int joinIndex)
 	} else {
 		int idx = convertIndex(joinIndex);
 		Assert( idx >= 0 && idx < state->size );
-		if( subplans[idx] == NULL ) {
+		if( state->nodes[idx] == NULL ) {
 			treeNode *sub0, *sub1;
-			sub0 = joinSubplans(state,subplans,
-					state->elementList[idx].child[0]);
-			sub1 = joinSubplans(state,subplans,
-					state->elementList[idx].child[1]);
+			int       i;
 
-			subplans[idx] = joinNodes(state->essentials, sub0, sub1);
+			for( i=0; i<2; i++ ){
+				int child = state->elementList[idx].child[i];
+				if( isJoinIndex(child) )
+					state->parents[convertIndex(child)] = idx;
+			}
+			sub0 = joinSubplans(state, state->elementList[idx].child[0],
+					bound);
+			if( !sub0 )
+				return NULL;
+			sub1 = joinSubplans(state, state->elementList[idx].child[1],
+					bound);
+			if( !sub1 )
+				return NULL;
+
+			state->nodes[idx] = joinNodes(state->essentials, sub0, sub1);
+			if( exceedsBound(state->nodes[idx], bound) )
+				return NULL;
 		}
-		return subplans[idx];
+		return state->nodes[idx];
 	}
 
 }
 
+/**
+ * buildBushyTree:
+ *    The root of a bushy state is always its last element (see
+ *    encodeBushyTree()). Neighbor moves never change it.
+ */
 static treeNode *
-buildBushyTree( State *state )
+buildBushyTree( State *state, Cost bound )
 {
-	int        i;
-	treeNode **subplans;
-	treeNode  *result = NULL;
+	int root;
 
 	Assert( state != NULL );
 	Assert( state->type == stBushy );
 
-	subplans = (treeNode**)palloc0(sizeof(treeNode*)*state->size);
-	for( i=0; i< state->size; i++ ){
-		if( subplans[i] == NULL )
-			result = joinSubplans(state,subplans,convertIndex(i));
-	}
-	pfree(subplans);
+	root = state->size -1;
+	state->parents[root] = -1;
 
-	return result;
+	return joinSubplans(state, convertIndex(root), bound);
 }
 
+/**
+ * buildLeftDeepTree:
+ *    state->nodes[i] is the join of the first i+1 relations. Only the
+ *    invalid suffix of this list is rebuilt.
+ *    Returns NULL if a prefix exceeds "bound" (see exceedsBound()).
+ */
 static treeNode *
-buildLeftDeepTree( State *state )
+buildLeftDeepTree( State *state, Cost bound )
 {
 	int        i;
-	treeNode  *result = NULL;
+	treeNode **nodes;
+	treeNode  *nodeList;
 
 	Assert( state != NULL );
 	Assert( state->type == stLeftDeep );
@@ -747,22 +1174,126 @@ buildLeftDeepTree( State *state )
 	Assert( state->elementList[0].rel >= 0 &&
 			state->elementList[0].rel < state->essentials->numNodes );
 
-	result = &(state->essentials->nodeList[ state->elementList[0].rel ]);
+	nodes = state->nodes;
+	nodeList = state->essentials->nodeList;
+
+	if( nodes[0] == NULL )
+		nodes[0] = &(nodeList[ state->elementList[0].rel ]);
 	for( i=1; i< state->size; i++ ){
 		Assert( state->elementList[i].rel >= 0 &&
 				state->elementList[i].rel < state->essentials->numNodes );
 
-		result = joinNodes(
-				state->essentials,
-				result,
-				&(state->essentials->nodeList[ state->elementList[i].rel ]));
+		if( nodes[i] == NULL ) {
+			nodes[i] = joinNodes(
+					state->essentials,
+					nodes[i-1],
+					&(nodeList[ state->elementList[i].rel ]));
+			if( exceedsBound(nodes[i], bound) )
+				return NULL;
+		}
 	}
 
-	return result;
+	return nodes[state->size -1];
+}
+
+#ifdef TWOPO_CACHE_PLANS
+/**
+ * setLiveStates:
+ *    Registers the current and the best states of the running phase. Their
+ *    nodes are kept by evictCache().
+ */
+static inline void
+setLiveStates( twopoEssentials *essentials, State *current, State *best )
+{
+	Assert( essentials != NULL );
+
+	essentials->curState = current;
+	essentials->bestState = best;
+}
+
+/**
+ * evictCache:
+ *    Called when the join cache exceeds twopo_cache_size.
+ *
+ *    Join nodes cannot be freed one by one: paths of a join point to paths
+ *    of its children and RelOptInfos are shared through
+ *    root->join_rel_list. Therefore the nodes of the live states (see
+ *    setLiveStates()) are rebuilt in a new temporary context and the old
+ *    one, with every other cached node, is deleted. Search continues from
+ *    a warm cache instead of an empty one.
+ *
+ *    Live states are only kept while they use less than half of the cache.
+ *    Their size is kept in liveBytes, so the next eviction only happens
+ *    after new nodes fill half of the cache (see contextSizeIsExcedded()).
+ */
+static void
+evictCache( twopoEssentials *essentials )
+{
+	MemoryContext  oldcontext;
+	State         *live[2];
+	int            i;
+
+	Assert( essentials != NULL );
+
+	if ( ! essentials->ctx )
+		return;
+
+#	ifdef TWOPO_DEBUG
+	fprintf(stderr, "TwoPO DEBUG: evicting join cache.\n");
+#	endif
+#	if ENABLE_OPTE
+	essentials->opteCacheEvictions++;
+#	endif
+
+	oldcontext = essentials->ctx->mycontext;
+	essentials->ctx->mycontext = AllocSetContextCreate(essentials->ctx->oldcxt,
+									  "TwoPO Memory Context",
+									  ALLOCSET_DEFAULT_MINSIZE,
+									  ALLOCSET_DEFAULT_INITSIZE,
+									  ALLOCSET_DEFAULT_MAXSIZE);
+	MemoryContextSwitchTo(essentials->ctx->mycontext);
+
+	essentials->root->join_rel_list =
+		list_truncate(essentials->root->join_rel_list,
+			essentials->ctx->savelength);
+	essentials->root->join_rel_hash = NULL;
+	essentials->joinCache = NULL;
+	essentials->cacheBytes = 0;
+	essentials->generation++;
+
+	live[0] = essentials->curState;
+	live[1] = essentials->bestState;
+	for( i=0; i<2; i++ ){
+		State *state = live[i];
+
+		if( !state || state->generation != essentials->generation -1 )
+			continue;
+		if( essentials->cacheBytes >= ((Size) twopo_cache_size * 512) )
+			break;
+
+		resetStateNodes(state);
+		state->generation = essentials->generation;
+		if( state->type == stBushy )
+			buildBushyTree( state, NO_COST_BOUND );
+		else
+			buildLeftDeepTree( state, NO_COST_BOUND );
+	}
+	essentials->liveBytes = essentials->cacheBytes;
+
+	MemoryContextDelete(oldcontext);
 }
+#endif
 
+/**
+ * buildTree:
+ *    Builds the plan of "state" and sets its cost.
+ *
+ *    If "bound" is not NO_COST_BOUND, the construction stops as soon as a
+ *    partial plan costs at least "bound". In this case the state is marked
+ *    with COST_REJECTED and NULL is returned.
+ */
 static treeNode *
-buildTree( State *state )
+buildTree( State *state, Cost bound )
 {
 	treeNode  *result = NULL;
 
@@ -773,21 +1304,40 @@ buildTree( State *state )
 	 * Controlling temporary memory context size
 	 */
 #	ifdef TWOPO_CACHE_PLANS
-	if( !twopo_cache_plans || contextSizeIsExcedded(state->essentials) )
+	if( twopo_cache_plans ) {
+		if( contextSizeIsExcedded(state->essentials) )
+			evictCache(state->essentials);
+	} else
 #	endif
 		resetTemporaryContext(state->essentials);
 
+	/*
+	 * treeNodes of the state were freed with the temporary context
+	 */
+	if( state->generation != state->essentials->generation ) {
+		resetStateNodes(state);
+		state->generation = state->essentials->generation;
+	}
+
 #	ifdef TWOPO_DEBUG_2
 	fprintf(stderr,"TwoPO DEBUG: Building State   = ");
 	debugPrintState( state );
 #	endif
 
 	if( state->type == stBushy )
-		result = buildBushyTree( state );
+		result = buildBushyTree( state, bound );
 	else
-		result = buildLeftDeepTree( state );
+		result = buildLeftDeepTree( state, bound );
+
+	if( result == NULL ) {
+		Assert( bound != NO_COST_BOUND );
+#		if ENABLE_OPTE
+		state->essentials->opteCutoffStates++;
+#		endif
+		state->cost = COST_REJECTED;
+		return NULL;
+	}
 
-	Assert( result != NULL );
 	Assert( result->rel != NULL );
 	state->cost = nodeCost(result);
 
@@ -797,50 +1347,461 @@ buildTree( State *state )
 }
 
 //////////////////////////////////////////////////////////////////////////////
-/////////////////////// Initial States Functions /////////////////////////////
+///////////////////////// Rows-only evaluation ///////////////////////////////
 
 /**
- * heuristicState_1_qsort
- * Heuristic initial state [2]. qsort function.
+ * crossSelectivity:
+ *    Selectivity of the join between the base relations of "mask1" and the
+ *    ones of "mask2": the product of the selectivities of the edges between
+ *    both sets (see createSelectivities()).
+ *
+ *    The planner applies one clause of each equivalence class to a join,
+ *    however many members it has on each side. So each class is counted
+ *    once, with the selectivity of the first crossing edge it produced.
  */
-static int
-heuristicState_1_qsort(const void* x, const void* y)
+static Selectivity
+crossSelectivity(twopoEssentials *essentials, uint64 *mask1, uint64 *mask2)
 {
-	if (((HeuristicStruct*)x)->cost > ((HeuristicStruct*)y)->cost)
-		return 1;
-	else if (((HeuristicStruct*)x)->cost < ((HeuristicStruct*)y)->cost)
-		return -1;
+	ljqo_graph  *graph = essentials->graph;
+	Selectivity  sel   = 1.0;
+	int          w, k, e;
 
-	return 0;
+	memset(essentials->ecSeen, 0, sizeof(uint64) * essentials->ecWords);
+
+	for( w=0; w<essentials->maskWords; w++ ){
+		uint64 bits = mask1[w];
+
+		while( bits ){
+			int rel = w * MASK_WORD_BITS + lowestBit(bits);
+
+			for( k=graph->adj_start[rel]; k<graph->adj_start[rel+1]; k++ ){
+				if( !maskIsSet(mask2, graph->adj[k]) )
+					continue;
+				sel *= essentials->selValue[k];
+				for( e=essentials->ecFirst[k];
+						e<essentials->ecFirst[k] + essentials->ecCount[k]; e++ ){
+					EdgeClass *item = &essentials->ecItems[e];
+
+					if( !maskIsSet(essentials->ecSeen, item->ec) ) {
+						maskSet(essentials->ecSeen, item->ec);
+						sel *= item->sel;
+					}
+				}
+			}
+			bits &= bits -1;
+		}
+	}
+
+	return sel;
 }
 
 /**
- * heuristicState_1
- * Heuristic initial state [2].
+ * estimateJoinRows:
+ *    Estimated size of the join between two sets of base relations.
  */
-static Edge *
-heuristicState_1(twopoEssentials *essentials)
+static inline double
+estimateJoinRows(twopoEssentials *essentials, double rows1, uint64 *mask1,
+		double rows2, uint64 *mask2)
 {
-	Edge            *edgeList;
-	HeuristicStruct *elements;
-	int              numEdges;
+	return clamp_row_est(rows1 * rows2
+			* crossSelectivity(essentials, mask1, mask2));
+}
+
+/**
+ * estimatePairRows:
+ *    Estimated size of the join between two base relations.
+ */
+static double
+estimatePairRows(twopoEssentials *essentials, int rel1, int rel2)
+{
+	int     words = essentials->maskWords;
+	uint64 *mask1 = essentials->scratchMasks;
+	uint64 *mask2 = essentials->scratchMasks + words;
+
+	memset(mask1, 0, sizeof(uint64) * words * 2);
+	maskSet(mask1, rel1);
+	maskSet(mask2, rel2);
+
+	return estimateJoinRows(essentials,
+			essentials->nodeList[rel1].rel->rows, mask1,
+			essentials->nodeList[rel2].rel->rows, mask2);
+}
+
+/**
+ * estimateSubtree:
+ *    Estimated size of the bushy subtree rooted at element "idx". The sizes
+ *    of its joins are added to "cost".
+ */
+static double
+estimateSubtree(State *state, int idx, Cost *cost)
+{
+	twopoEssentials *essentials = state->essentials;
+	int              words = essentials->maskWords;
+	double           rows[2];
+	uint64          *mask[2];
 	int              i;
 
-	Assert( essentials != NULL );
-	Assert( essentials->numEdges > 0 );
+	// subtrees first: they use the scratch masks too
+	for( i=0; i<2; i++ ){
+		int child = state->elementList[idx].child[i];
+		if( isJoinIndex(child) )
+			rows[i] = estimateSubtree(state, convertIndex(child), cost);
+		else
+			rows[i] = essentials->nodeList[child].rel->rows;
+	}
 
-	numEdges = essentials->numEdges;
-	elements = (HeuristicStruct*)palloc(sizeof(HeuristicStruct)*numEdges);
+	for( i=0; i<2; i++ ){
+		int child = state->elementList[idx].child[i];
+		if( isJoinIndex(child) ) {
+			mask[i] = elementRelMask(state, convertIndex(child));
+		} else {
+			mask[i] = essentials->scratchMasks + i * words;
+			memset(mask[i], 0, sizeof(uint64) * words);
+			maskSet(mask[i], child);
+		}
+	}
 
-	for( i=0; i<numEdges; i++ ){
-		treeNode *node;
+	rows[0] = estimateJoinRows(essentials, rows[0], mask[0], rows[1], mask[1]);
+	*cost += rows[0];
 
-		elements[i].edge = &(essentials->edgeList[i]);
+	return rows[0];
+}
 
-		Assert( essentials->edgeList[i].node[0] >= 0 &&
+/**
+ * estimateState:
+ *    Sets the cost of "state" without building its plan. The cost is the
+ *    sum of the estimated sizes of its joins (C_out), computed from the
+ *    sizes of the base relations and the selectivities of the edges.
+ */
+static void
+estimateState( State *state )
+{
+	twopoEssentials *essentials = state->essentials;
+	Cost             cost = 0;
+
+	Assert( essentials->rowsOnly );
+
+	if( state->type == stBushy ) {
+		estimateSubtree(state, state->size -1, &cost);
+	} else {
+		int     words  = essentials->maskWords;
+		uint64 *joined = essentials->scratchMasks;
+		uint64 *next   = essentials->scratchMasks + words;
+		double  rows;
+		int     i;
+
+		memset(joined, 0, sizeof(uint64) * words * 2);
+		maskSet(joined, state->elementList[0].rel);
+		rows = essentials->nodeList[ state->elementList[0].rel ].rel->rows;
+
+		for( i=1; i<state->size; i++ ){
+			int rel = state->elementList[i].rel;
+
+			maskSet(next, rel);
+			rows = estimateJoinRows(essentials,
+					essentials->nodeList[rel].rel->rows, next, rows, joined);
+			cost += rows;
+			maskSet(joined, rel);
+			next[rel / MASK_WORD_BITS] = 0;
+		}
+	}
+
+	state->cost = cost;
+}
+
+/**
+ * keepFinalist:
+ *    Offers an estimated state to the finalists: the twopo_finalists
+ *    cheapest distinct states seen by a rows-only search.
+ */
+static void
+keepFinalist( State *state, uint64 fingerprint )
+{
+	twopoEssentials *essentials = state->essentials;
+	int              worst = -1;
+	int              i;
+
+	for( i=0; i<essentials->numFinalists; i++ ){
+		if( essentials->finalistPrints[i] == fingerprint )
+			return;
+		if( worst < 0 ||
+				essentials->finalists[i]->cost > essentials->finalists[worst]->cost )
+			worst = i;
+	}
+
+	if( essentials->numFinalists < twopo_finalists ) {
+		i = essentials->numFinalists++;
+		essentials->finalists[i] = copyState(NULL, state);
+	} else if( state->cost < essentials->finalists[worst]->cost ) {
+		i = worst;
+		copyState(essentials->finalists[i], state);
+	} else {
+		return;
+	}
+	essentials->finalistPrints[i] = fingerprint;
+}
+
+/**
+ * planFinalists:
+ *    Builds the plans of "state" and of the finalists, and keeps in "state"
+ *    the one of lowest cost. The estimated costs only rank the states; the
+ *    winner is chosen by the costs of the planner.
+ */
+static void
+planFinalists( State *state )
+{
+	twopoEssentials *essentials = state->essentials;
+	int              i;
+
+#	ifdef TWOPO_CACHE_PLANS
+	setLiveStates(essentials, NULL, state);
+#	endif
+	buildTree( state, NO_COST_BOUND );
+
+	for( i=0; i<essentials->numFinalists; i++ ){
+		State *finalist = essentials->finalists[i];
+
+		buildTree( finalist, NO_COST_BOUND );
+		if( finalist->cost < state->cost )
+			copyState(state, finalist);
+	}
+#	ifdef TWOPO_CACHE_PLANS
+	setLiveStates(essentials, NULL, NULL);
+#	endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+///////////////////////// Visited-state memo /////////////////////////////////
+
+/**
+ * mixHash:
+ *    64-bit finalizer (splitmix64).
+ */
+static inline uint64
+mixHash(uint64 x)
+{
+	x = (x ^ (x >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+	x = (x ^ (x >> 27)) * UINT64CONST(0x94D049BB133111EB);
+	return x ^ (x >> 31);
+}
+
+/**
+ * subtreeHash:
+ *    Hash of the bushy subtree rooted at element "idx". The children of
+ *    each join are combined in a fixed order, so the hash does not depend
+ *    on the positions of the elements in elementList nor on the side of
+ *    each child. Different seeds give independent hashes.
+ */
+static uint64
+subtreeHash(State *state, int idx, uint64 seed)
+{
+	uint64 h[2];
+	int    i;
+
+	for( i=0; i<2; i++ ){
+		int child = state->elementList[idx].child[i];
+		if( isJoinIndex(child) )
+			h[i] = subtreeHash(state, convertIndex(child), seed);
+		else
+			h[i] = mixHash(((uint64) child + 1) ^ seed);
+	}
+
+	if( h[0] > h[1] )
+		swapValues(uint64, h[0], h[1]);
+
+	return mixHash((h[0] + UINT64CONST(0x9E3779B97F4A7C15) * (h[1] + 1))
+			^ seed);
+}
+
+/**
+ * stateHash:
+ *    Hash of the join order of "state" with "seed".
+ */
+static uint64
+stateHash(State *state, uint64 seed)
+{
+	uint64 h;
+	int    i;
+
+	if( state->type == stBushy ) {
+		h = subtreeHash(state, state->size -1, seed);
+	} else {
+		// the first two relations are joined together in any order
+		int r0 = state->elementList[0].rel;
+		int r1 = state->elementList[1].rel;
+		if( r0 > r1 )
+			swapValues(int, r0, r1);
+		h = mixHash( (((uint64) r0 << 32) | (uint64) r1) ^ seed );
+		for( i=2; i<state->size; i++ )
+			h = mixHash((h * UINT64CONST(0x9E3779B97F4A7C15)
+					+ (uint64) state->elementList[i].rel + 1) ^ seed);
+	}
+
+	return h;
+}
+
+/**
+ * stateFingerprint:
+ *    Fingerprint of the join order of "state". Never 0.
+ */
+static uint64
+stateFingerprint(State *state)
+{
+	uint64 h = stateHash(state, 0);
+
+	return h ? h : 1;
+}
+
+/**
+ * createStateMemo:
+ *    Allocates the memo with twopo_state_memo_size entries, rounded down to
+ *    a power of two. The memo lives in the caller's memory context, so it
+ *    survives resets of the temporary context.
+ */
+static void
+createStateMemo( twopoEssentials *essentials )
+{
+	uint64 entries = 1;
+
+	if( twopo_state_memo_size <= 0 )
+		return;
+
+	while( entries * 2 <= (uint64) twopo_state_memo_size )
+		entries *= 2;
+
+	essentials->stateMemo = (stateMemoEntry*)
+			palloc0(sizeof(stateMemoEntry) * entries);
+	essentials->stateMemoMask = entries -1;
+}
+
+/**
+ * stateMemoLookup:
+ *    Returns the memo entry of "fingerprint", or the entry where it must be
+ *    stored: the first empty slot in STATE_MEMO_PROBES slots, or the home
+ *    slot if all of them are used.
+ */
+static stateMemoEntry *
+stateMemoLookup( twopoEssentials *essentials, uint64 fingerprint )
+{
+	stateMemoEntry *memo = essentials->stateMemo;
+	uint64          mask = essentials->stateMemoMask;
+	uint64          home = fingerprint & mask;
+	int             i;
+
+	for( i=0; i<STATE_MEMO_PROBES; i++ ){
+		stateMemoEntry *entry = &memo[(home + i) & mask];
+		if( entry->fingerprint == fingerprint || entry->fingerprint == 0 )
+			return entry;
+	}
+
+	return &memo[home];
+}
+
+/**
+ * evaluateState:
+ *    Sets the cost of "state". States visited before take their cost from
+ *    the memo, without building the plan. The nodes of "state" are left as
+ *    they are; invalidated ones are rebuilt by a later buildTree().
+ *    In rows-only mode the cost is estimated (see estimateState()).
+ *    See buildTree() for "bound".
+ */
+static void
+evaluateState( State *state, Cost bound )
+{
+	twopoEssentials *essentials = state->essentials;
+	stateMemoEntry  *entry = NULL;
+	uint64           fingerprint;
+	uint64           check = 0;
+
+	if( essentials->stateMemo == NULL && !essentials->rowsOnly ) {
+		buildTree( state, bound );
+		return;
+	}
+
+	fingerprint = stateFingerprint(state);
+
+	if( essentials->stateMemo ) {
+		check = stateHash(state, STATE_CHECK_SEED);
+		entry = stateMemoLookup(essentials, fingerprint);
+#		if ENABLE_OPTE
+		essentials->opteMemoLookups++;
+#		endif
+
+		if( entry->fingerprint == fingerprint && entry->check == check ) {
+#			if ENABLE_OPTE
+			essentials->opteMemoHits++;
+#			endif
+			state->cost = entry->cost;
+			return;
+		}
+	}
+
+	if( essentials->rowsOnly ) {
+		estimateState( state );
+		keepFinalist( state, fingerprint );
+	} else {
+		buildTree( state, bound );
+	}
+
+	// the cost of a plan stopped by the bound is unknown
+	if( entry && state->cost != COST_REJECTED ) {
+		entry->fingerprint = fingerprint;
+		entry->check       = check;
+		entry->cost        = state->cost;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////// Initial States Functions /////////////////////////////
+
+/**
+ * heuristicState_1_qsort
+ * Heuristic initial state [2]. qsort function.
+ */
+static int
+heuristicState_1_qsort(const void* x, const void* y)
+{
+	if (((HeuristicStruct*)x)->cost > ((HeuristicStruct*)y)->cost)
+		return 1;
+	else if (((HeuristicStruct*)x)->cost < ((HeuristicStruct*)y)->cost)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * heuristicState_1
+ * Heuristic initial state [2].
+ */
+static Edge *
+heuristicState_1(twopoEssentials *essentials)
+{
+	Edge            *edgeList;
+	HeuristicStruct *elements;
+	int              numEdges;
+	int              i;
+
+	Assert( essentials != NULL );
+	Assert( essentials->numEdges > 0 );
+
+	numEdges = essentials->numEdges;
+	elements = (HeuristicStruct*)palloc(sizeof(HeuristicStruct)*numEdges);
+
+	for( i=0; i<numEdges; i++ ){
+		treeNode *node;
+
+		elements[i].edge = &(essentials->edgeList[i]);
+
+		Assert( essentials->edgeList[i].node[0] >= 0 &&
 				essentials->edgeList[i].node[0] < essentials->numNodes );
 		Assert( essentials->edgeList[i].node[1] >= 0 &&
 				essentials->edgeList[i].node[1] < essentials->numNodes );
+		if( essentials->rowsOnly ) {
+			elements[i].cost = estimatePairRows(essentials,
+					essentials->edgeList[i].node[0],
+					essentials->edgeList[i].node[1]);
+			continue;
+		}
 		node = joinNodes(
 			essentials,
 			&(essentials->nodeList[ essentials->edgeList[i].node[0] ]),
@@ -882,7 +1843,7 @@ randomState(twopoEssentials *essentials)
 	memcpy(edgeList, essentials->edgeList, sizeof(Edge)*numEdges);
 
 	for ( i=0; i<numEdges; i++ ){
-		int item = random() % (numEdges - i);
+		int item = ljqo_random_int(&essentials->random, numEdges - i);
 		if( item != i )
 			swapValues(Edge, edgeList[i], edgeList[item+i] );
 	}
@@ -927,12 +1888,15 @@ makeInitialState(State *output, twopoEssentials *essentials,
 				essentials->numNodes );
 
 	pfree(edgeList);
+	resetStateNodes(output);
+	if( type == stBushy )
+		buildRelMasks(output, output->size -1);
 
 #	ifdef TWOPO_DEBUG_2
 	fprintf(stderr,"TwoPO DEBUG: Initial State    = ");
 	debugPrintState(output);
 #	endif
-	buildTree( output );
+	evaluateState( output, NO_COST_BOUND );
 
 	return output;
 }
@@ -940,89 +1904,116 @@ makeInitialState(State *output, twopoEssentials *essentials,
 //////////////////////////////////////////////////////////////////////////////
 ////////////////////// State's Transformation Functions //////////////////////
 
-static twopoList*
-baserelsOfSubtree(twopoList *output, int value,
-		Element *joinList, int joinListSize)
+/**
+ * isAdjacentToSubtree:
+ *   Verifies whether the base relation "rel" has an edge to any base
+ *   relation of the subtree "subIdx".
+ */
+static inline bool
+isAdjacentToSubtree(State *state, int rel, int subIdx)
 {
-	Assert( value >= 0 || convertIndex(value) < joinListSize );
-
-	if( !output )
-		output = listCreate(sizeof(int), joinListSize+1 , NULL);
-
-	if( isJoinIndex(value) ) {
-		baserelsOfSubtree(
-				output,
-				joinList[convertIndex(value)].child[0],
-				joinList, joinListSize);
-		baserelsOfSubtree(
-				output,
-				joinList[convertIndex(value)].child[1],
-				joinList, joinListSize);
-	} else {
-		listAdd(output, &value);
+	twopoEssentials *essentials = state->essentials;
+	uint64          *adjRow;
+	uint64          *mask;
+	int              w;
+
+	if( !isJoinIndex(subIdx) )
+		return isAdjacent(essentials, rel, subIdx);
+
+	adjRow = &(essentials->adj[rel * essentials->maskWords]);
+	mask   = elementRelMask(state, convertIndex(subIdx));
+	for( w=0; w<essentials->maskWords; w++ ){
+		if( adjRow[w] & mask[w] )
+			return true;
 	}
 
-	return output;
+	return false;
 }
 
 static bool
 hasEdgeBetweenSubtrees(State *state, int subIdx1, int subIdx2)
 {
-	bool       result = false;
-	twopoList *list1;
-	twopoList *list2;
-	size_t     listsize1;
-	size_t     listsize2;
-	size_t     i,j;
-
-	list1 = baserelsOfSubtree(NULL, subIdx1, state->elementList, state->size);
-	list2 = baserelsOfSubtree(NULL, subIdx2, state->elementList, state->size);
+	uint64 *mask;
+	int     w;
 
-	listsize1 = listSize(list1);
-	listsize2 = listSize(list2);
+	if( !isJoinIndex(subIdx1) )
+		return isAdjacentToSubtree(state, subIdx1, subIdx2);
 
-	for( i=0; i<listsize1; i++ ){
-		int val1;
-		listGetElement(&val1,list1,i);
-		Assert( val1 >= 0 && val1 < state->essentials->numNodes );
+	mask = elementRelMask(state, convertIndex(subIdx1));
+	for( w=0; w<state->essentials->maskWords; w++ ){
+		uint64 bits = mask[w];
 
-		for( j=0; j<listsize2; j++ ){
-			int val2;
-			listGetElement(&val2,list2,j);
-			Assert( val2 >=0 && val2 < state->essentials->numNodes );
+		while( bits ){
+			int rel = w * MASK_WORD_BITS + lowestBit(bits);
 
-			if( state->essentials->adj[val1][val2] ){
-				result = true;
-				break;
-			}
+			Assert( rel < state->essentials->numNodes );
+			if( isAdjacentToSubtree(state, rel, subIdx2) )
+				return true;
+			bits &= bits -1;
 		}
-
-		if( result )
-			break;
 	}
 
-	listDestroy(list1);
-	listDestroy(list2);
+	return false;
+}
 
-	return result;
+/**
+ * updateRelMask:
+ *   The subtree "removed" of the element "idx" was replaced by "added".
+ *   As both are disjoint, and "removed" is included in the mask, the new
+ *   mask is given by XOR.
+ */
+static void
+updateRelMask(State *state, int idx, int removed, int added)
+{
+	int     w;
+	int     words = state->essentials->maskWords;
+	uint64 *mask  = elementRelMask(state, idx);
+	int     i;
+	int     sub[2];
+
+	sub[0] = removed;
+	sub[1] = added;
+	for( i=0; i<2; i++ ){
+		if( isJoinIndex(sub[i]) ) {
+			uint64 *subMask = elementRelMask(state, convertIndex(sub[i]));
+			for( w=0; w<words; w++ )
+				mask[w] ^= subMask[w];
+		} else {
+			mask[sub[i] / MASK_WORD_BITS] ^=
+				((uint64) 1) << (sub[i] % MASK_WORD_BITS);
+		}
+	}
 }
 
-static State *
-neighbordStateBushy(State *output, State *input)
+/**
+ * recordSlot:
+ *   Saves a position of elementList in "move" before it is modified.
+ */
+static inline void
+recordSlot(Move *move, int *slot)
+{
+	Assert( move->numSlots < 3 );
+	move->slot[move->numSlots] = slot;
+	move->oldValue[move->numSlots] = *slot;
+	move->numSlots++;
+}
+
+static void
+neighbordStateBushy(State *output, Move *move)
 {
 	bool     ok = false;
 	Element *join;
 	int      i;
 	int      j;
+	int      fatherIdx;
 	int     *father;
 	int     *uncle;
 	int     *child;
 	int     *brother;
 
-	Assert( input != NULL );
-	Assert( input->type == stBushy );
+	Assert( output != NULL );
+	Assert( output->type == stBushy );
 
-	output = copyState(output,input);
 #	ifdef TWOPO_DEBUG
 	//fprintf(stderr,"TwoPO DEBUG: neighbordStateBushy = ");
 	//debugPrintState(output);
@@ -1030,7 +2021,8 @@ neighbordStateBushy(State *output, State *input)
 
 	while( !ok ) {
 
-		join = &(output->elementList[ random() % output->size ]);
+		join = &(output->elementList[
+				ljqo_random_int(&output->essentials->random, output->size) ]);
 		//fprintf(stderr,"join=(%d,%d)\n", join->edge[0], join->edge[1]);
 		father = &(join->child[0]);
 		uncle  = &(join->child[1]);
@@ -1053,7 +2045,16 @@ neighbordStateBushy(State *output, State *input)
 						//fprintf(stderr,"child=%d\n", *child);
 						//fprintf(stderr,"brother=%d\n", *brother);
 						// swapping uncle <--> child
+						recordSlot(move, child);
+						recordSlot(move, uncle);
 						swapValues(int, *child, *uncle);
+						// only father and its ancestors are modified
+						fatherIdx = convertIndex(*father);
+						move->fatherIdx = fatherIdx;
+						move->joinIdx = join - output->elementList;
+						invalidateStateNodes(output, fatherIdx, move);
+						updateRelMask(output, fatherIdx, *uncle, *child);
+						move->applied = true;
 						ok = true;
 						break;
 					}
@@ -1067,8 +2068,6 @@ neighbordStateBushy(State *output, State *input)
 				break;
 		}
 	}
-
-	return output;
 }
 
 static bool
@@ -1083,113 +2082,418 @@ canRelPushedDown(int rel, int pos, State* state)
 		Assert( state->elementList[i].rel >= 0 &&
 				state->elementList[i].rel < state->essentials->numNodes);
 
-		if( state->essentials->adj[rel][ state->elementList[i].rel ] )
+		if( isAdjacent(state->essentials, rel, state->elementList[i].rel) )
 			return true;
 	}
 
 	return false;
 }
 
-static State *
-neighbordStateLeftDeep(State *output, State *input, bool *fail)
+static void
+neighbordStateLeftDeep(State *output, Move *move)
 {
-	int idx;
-
-	Assert( input != NULL );
-	Assert( input->type == stLeftDeep );
+	int                idx;
+	ljqo_random_state *rnd;
 
-	output = copyState(output,input);
+	Assert( output != NULL );
+	Assert( output->type == stLeftDeep );
 
-	*fail = true;
-	if( input->size == 2 || random()%2 ){ ///// swap method [3] ////
-		idx = random()%(input->size -1);
+	rnd = &output->essentials->random;
+	if( output->size == 2 || ljqo_random_int(rnd,2) ){ // swap method [3] //
+		idx = ljqo_random_int(rnd, output->size -1);
 		if(canRelPushedDown(output->elementList[idx+1].rel, idx, output)){
+			recordSlot(move, &(output->elementList[idx].rel));
+			recordSlot(move, &(output->elementList[idx+1].rel));
 			swapValues(int,
 					output->elementList[idx].rel,
 					output->elementList[idx+1].rel);
-			*fail = false;
+			invalidateStateNodes(output, idx, move);
+			move->applied = true;
 		}
 	} else { ///////////////////////////////// 3-cycle method [3] //
-		idx = random()%(input->size -2);
+		idx = ljqo_random_int(rnd, output->size -2);
 		if(canRelPushedDown(output->elementList[idx+2].rel, idx, output)){
+			recordSlot(move, &(output->elementList[idx].rel));
+			recordSlot(move, &(output->elementList[idx+1].rel));
+			recordSlot(move, &(output->elementList[idx+2].rel));
 			swapValues(int,
 					output->elementList[idx].rel,
 					output->elementList[idx+1].rel);
 			swapValues(int,
 					output->elementList[idx+1].rel,
 					output->elementList[idx+2].rel);
-			*fail = false;
+			invalidateStateNodes(output, idx, move);
+			move->applied = true;
 		}
 	}
+}
 
-	return output;
+/**
+ * createMove:
+ *   Allocates an undo record for moves on states of "essentials".
+ */
+static Move *
+createMove(twopoEssentials *essentials)
+{
+	Move *move;
+
+	Assert( essentials != NULL );
+
+	move = (Move*)safeContextAlloc(essentials, sizeof(Move));
+	move->nodeIdx = (int*)safeContextAlloc(essentials,
+			sizeof(int) * essentials->numNodes);
+	move->nodeVal = (treeNode**)safeContextAlloc(essentials,
+			sizeof(treeNode*) * essentials->numNodes);
+	move->applied = false;
+
+	return move;
 }
 
-static State *
-neighbordState(State *output, State *input)
+static void
+destroyMove(Move *move)
 {
-	Assert( input != NULL );
-	Assert( input->type == stBushy || input->type == stLeftDeep );
+	if( !move )
+		return;
+
+	pfree(move->nodeIdx);
+	pfree(move->nodeVal);
+	pfree(move);
+}
+
+/**
+ * neighbordState:
+ *   Applies a random move on "state" and builds the new plan. The move is
+ *   recorded in "move", so it can be reverted with undoMove().
+ *   move->applied is false if no valid move was found.
+ *   See buildTree() for "bound".
+ */
+static void
+neighbordState(State *state, Move *move, Cost bound)
+{
+	Assert( state != NULL );
+	Assert( move != NULL );
+	Assert( state->type == stBushy || state->type == stLeftDeep );
+
+	move->applied    = false;
+	move->numSlots   = 0;
+	move->numNodes   = 0;
+	move->cost       = state->cost;
+	move->generation = state->generation;
 
-	if( input->type == stBushy ){
-		output = neighbordStateBushy(output, input);
+	if( state->type == stBushy ){
+		neighbordStateBushy(state, move);
 #		ifdef TWOPO_DEBUG_2
 		fprintf(stderr,"TwoPO DEBUG: Neighbord State  = ");
-		debugPrintState(output);
+		debugPrintState(state);
 #		endif
-		buildTree( output );
+		evaluateState( state, bound );
 	} else {
-		bool fail;
-		output = neighbordStateLeftDeep(output, input, &fail);
+		neighbordStateLeftDeep(state, move);
 #		ifdef TWOPO_DEBUG_2
 		fprintf(stderr,"TwoPO DEBUG: Neighbord State  = ");
 #		endif
-		if( !fail ) {
+		if( move->applied ) {
 #			ifdef TWOPO_DEBUG_2
-			debugPrintState(output);
+			debugPrintState(state);
 #			endif
-			buildTree( output );
+			evaluateState( state, bound );
 #		ifdef TWOPO_DEBUG_2
 		} else {
 			fprintf(stderr,"failed\n");
 #		endif
 		}
 	}
+}
 
-	return output;
+/**
+ * undoMove:
+ *   Reverts the last move applied on "state" by neighbordState().
+ *
+ *   If the temporary context was reset while the move was built, the
+ *   restored nodes belong to an old generation and will be discarded by
+ *   the next buildTree().
+ */
+static void
+undoMove(State *state, Move *move)
+{
+	int i;
+
+	Assert( state != NULL );
+	Assert( move != NULL );
+
+	if( !move->applied )
+		return;
+
+	for( i=move->numSlots -1; i>=0; i-- )
+		*(move->slot[i]) = move->oldValue[i];
+
+	for( i=0; i<move->numNodes; i++ )
+		state->nodes[ move->nodeIdx[i] ] = move->nodeVal[i];
+
+	if( state->type == stBushy ) {
+		int idx[2];
+		int k;
+
+		// subtrees exchanged again: old and new masks differ by the same XOR
+		updateRelMask(state, move->fatherIdx,
+				*(move->slot[1]), *(move->slot[0]));
+
+		idx[0] = move->fatherIdx;
+		idx[1] = move->joinIdx;
+		for( k=0; k<2; k++ ){
+			for( i=0; i<2; i++ ){
+				int child = state->elementList[idx[k]].child[i];
+				if( isJoinIndex(child) )
+					state->parents[convertIndex(child)] = idx[k];
+			}
+		}
+	}
+
+	state->cost       = move->cost;
+	state->generation = move->generation;
+	move->applied     = false;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 ////////////////////// essentials structure construction /////////////////////
 
 /**
- * isDesirableEdge:
- *    Evita produtos cartesianos na construção da lista de arestas.
+ * addEdge:
+ *    Adiciona a aresta (i,j) na lista de arestas e na matriz de adjacência.
  */
-static bool
-isDesirableEdge( PlannerInfo *root, RelOptInfo *rel1, RelOptInfo *rel2 )
+static void
+addEdge(twopoList *edgeList, uint64 *adj, int words, bool *has_adj,
+		int i, int j)
+{
+	Edge edge;
+
+	edge.node[0] = i;
+	edge.node[1] = j;
+	listAdd(edgeList, &edge);
+	has_adj[i] = true;
+	has_adj[j] = true;
+	maskSet(&adj[i * words], j);
+	maskSet(&adj[j * words], i);
+}
+
+/**
+ * componentRoot:
+ *    Raiz da componente de "i" na floresta union-find "parent".
+ */
+static int
+componentRoot(int *parent, int i)
+{
+	while( parent[i] != i ) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+/**
+ * connectComponents:
+ *    Adds cross-product edges between the connected components of the edge
+ *    list, one between the first relations of each pair of components, so
+ *    that every join order is reachable through the edges (the encoding of
+ *    a state needs a spanning tree).
+ */
+static void
+connectComponents(twopoList *edgeList, uint64 *adj, int words, bool *has_adj,
+		int numNodes)
+{
+	int   *parent;
+	int   *reps;
+	int    numReps = 0;
+	int    numEdges;
+	int    i, j;
+
+	parent = (int*)palloc(sizeof(int) * numNodes);
+	for( i=0; i<numNodes; i++ )
+		parent[i] = i;
+
+	numEdges = listSize(edgeList);
+	for( i=0; i<numEdges; i++ ) {
+		Edge *edge = (Edge*)listElementPos(edgeList, i);
+		int   root1 = componentRoot(parent, edge->node[0]);
+		int   root2 = componentRoot(parent, edge->node[1]);
+
+		if( root1 != root2 )
+			parent[Max(root1, root2)] = Min(root1, root2);
+	}
+
+	// the lowest relation of each component is its root
+	reps = (int*)palloc(sizeof(int) * numNodes);
+	for( i=0; i<numNodes; i++ ) {
+		if( componentRoot(parent, i) == i )
+			reps[numReps++] = i;
+	}
+
+#	ifdef TWOPO_DEBUG
+	if( numReps > 1 )
+		fprintf(stderr, "TwoPO DEBUG: createEdgeSpace(): "
+				"connecting %d components.\n", numReps);
+#	endif
+	for( i=0; i<numReps; i++ ) {
+		for( j=i+1; j<numReps; j++ )
+			addEdge(edgeList, adj, words, has_adj, reps[i], reps[j]);
+	}
+
+	pfree(reps);
+	pfree(parent);
+}
+
+/**
+ * edgeClassIndex:
+ *    Position of an equivalence class in root->eq_classes.
+ */
+static int
+edgeClassIndex(PlannerInfo *root, EquivalenceClass *ec)
 {
-	return (
-	   !bms_overlap(rel1->relids, rel2->relids)
-	   && ( have_relevant_joinclause(root, rel1, rel2) ||
-			have_join_order_restriction(root, rel1, rel2))
-	   );
+	ListCell *lc;
+	int       i = 0;
+
+	foreach(lc, root->eq_classes) {
+		if( lfirst(lc) == ec )
+			return i;
+		i++;
+	}
+
+	elog(ERROR, "TwoPO: equivalence class not found");
+	return -1;
+}
+
+/**
+ * edgeSelectivity:
+ *    Selectivity of the join clauses between two base relations, computed
+ *    as make_join_rel() does for an inner join.
+ *
+ *    Clauses generated from equivalence classes are not included: one
+ *    EdgeClass per class is added to "classes" instead (see
+ *    crossSelectivity()).
+ */
+static Selectivity
+edgeSelectivity(PlannerInfo *root, RelOptInfo *rel1, RelOptInfo *rel2,
+		twopoList *classes)
+{
+	SpecialJoinInfo sjinfo;
+	Relids          joinrelids;
+	List           *ecClauses;
+	List           *clauses = NIL;
+	ListCell       *lc;
+	Selectivity     sel;
+
+	joinrelids = bms_union(rel1->relids, rel2->relids);
+	ecClauses = generate_join_implied_equalities(root, joinrelids,
+			rel1->relids, rel2);
+	foreach(lc, rel1->joininfo) {
+		RestrictInfo *rinfo = (RestrictInfo*)lfirst(lc);
+
+		if( bms_is_subset(rinfo->required_relids, joinrelids) )
+			clauses = lappend(clauses, rinfo);
+	}
+
+	// dummy SpecialJoinInfo of an inner join, as in make_join_rel()
+	sjinfo.type = T_SpecialJoinInfo;
+	sjinfo.min_lefthand = rel1->relids;
+	sjinfo.min_righthand = rel2->relids;
+	sjinfo.syn_lefthand = rel1->relids;
+	sjinfo.syn_righthand = rel2->relids;
+	sjinfo.jointype = JOIN_INNER;
+	sjinfo.lhs_strict = false;
+	sjinfo.delay_upper_joins = false;
+	sjinfo.join_quals = NIL;
+
+	foreach(lc, ecClauses) {
+		RestrictInfo *rinfo = (RestrictInfo*)lfirst(lc);
+		EdgeClass     item;
+
+		if( rinfo->parent_ec == NULL ) {
+			clauses = lappend(clauses, rinfo);
+			continue;
+		}
+		item.ec = edgeClassIndex(root, rinfo->parent_ec);
+		item.sel = clause_selectivity(root, (Node*)rinfo, 0, JOIN_INNER,
+				&sjinfo);
+		listAdd(classes, &item);
+	}
+
+	sel = clauselist_selectivity(root, clauses, 0, JOIN_INNER, &sjinfo);
+
+	list_free(ecClauses);
+	list_free(clauses);
+	bms_free(joinrelids);
+
+	return sel;
+}
+
+/**
+ * createSelectivities:
+ *    Keeps the query graph in "essentials" and computes the selectivity of
+ *    each of its edges, used by rows-only evaluation, and the equivalence
+ *    classes that join its relations. Edges added for cross-products have
+ *    selectivity 1 and are not in the graph.
+ */
+static void
+createSelectivities(twopoEssentials *essentials, ljqo_graph *graph)
+{
+	int        i, j, k, r;
+	int        slots = Max(graph->nedges * 2, 1);
+	twopoList *classes;
+
+	essentials->graph = graph;
+	essentials->selValue = (Selectivity*)
+			palloc(sizeof(Selectivity) * slots);
+	essentials->ecFirst = (int*)palloc(sizeof(int) * slots);
+	essentials->ecCount = (int*)palloc(sizeof(int) * slots);
+	essentials->ecWords =
+			Max(maskWordsFor(list_length(essentials->root->eq_classes)), 1);
+	essentials->ecSeen = (uint64*)
+			palloc(sizeof(uint64) * essentials->ecWords);
+	classes = listCreate(sizeof(EdgeClass), slots, NULL);
+
+	for( i=0; i<graph->nrels; i++ ){
+		for( k=graph->adj_start[i]; k<graph->adj_start[i+1]; k++ ){
+			j = graph->adj[k];
+			if( j < i )
+				continue;
+			essentials->ecFirst[k] = listSize(classes);
+			essentials->selValue[k] = edgeSelectivity(essentials->root,
+					essentials->nodeList[i].rel, essentials->nodeList[j].rel,
+					classes);
+			essentials->ecCount[k] = listSize(classes) - essentials->ecFirst[k];
+			// same edge seen from j
+			for( r=graph->adj_start[j]; r<graph->adj_start[j+1]; r++ ){
+				if( graph->adj[r] == i ) {
+					essentials->selValue[r] = essentials->selValue[k];
+					essentials->ecFirst[r] = essentials->ecFirst[k];
+					essentials->ecCount[r] = essentials->ecCount[k];
+				}
+			}
+		}
+	}
+
+	essentials->ecItems = (EdgeClass*)listDestroyControlOnly(classes);
 }
 
 /**
  * createEdges:
  *    Constroi a lista de arestas e a matriz de adjacência da consulta e
- *    guarda em "essentials".
+ *    guarda em "essentials". As arestas vêm do grafo da consulta
+ *    (ljqo_graph_create()), mais produtos cartesianos para relações
+ *    isoladas e entre componentes desconexas.
  */
 static void
 createEdges(twopoEssentials *essentials)
 {
-	int          i,j;
+	int          i,k;
 	bool        *has_adj;
 	twopoList   *edgeList;
 	treeNode    *nodeList;
 	int          numNodes;
-	bool       **adj;
+	int          words;
+	uint64      *adj;
+	RelOptInfo **rels;
+	ljqo_graph  *graph;
 
 	Assert( essentials != NULL );
 	Assert( essentials->nodeList != NULL );
@@ -1198,53 +2502,46 @@ createEdges(twopoEssentials *essentials)
 	numNodes = essentials->numNodes;
 	nodeList = essentials->nodeList;
 
-	edgeList = listCreate(sizeof(Edge), numNodes -1, NULL);
+	rels = (RelOptInfo**)palloc(sizeof(RelOptInfo*) * numNodes);
+	for( i=0; i<numNodes; i++ )
+		rels[i] = nodeList[i].rel;
+	graph = ljqo_graph_create(essentials->root, rels, numNodes);
+	pfree(rels);
+
+	edgeList = listCreate(sizeof(Edge), Max(graph->nedges, numNodes -1),
+			NULL);
 	/*
 	 * Criando matriz de adjacencia
 	 */
-	adj = (bool**)palloc(sizeof(bool*)*numNodes);
-	for( i=0; i<numNodes; i++ ){
-		adj[i] = (bool*)palloc0(sizeof(bool)*numNodes);
-	}
+	words = maskWordsFor(numNodes);
+	adj = (uint64*)palloc0(sizeof(uint64) * words * numNodes);
 
 	has_adj = (bool*)palloc0(sizeof(bool) * numNodes);
 	for( i=0; i<numNodes; i++ ) {
-		for( j=i; j<numNodes; j++ ) {
-			if( isDesirableEdge(essentials->root,
-					nodeList[i].rel,nodeList[j].rel) )
-			{
-				Edge edge;
-				edge.node[0] = i;
-				edge.node[1] = j;
-				listAdd(edgeList, &edge);
-				has_adj[i] = true;
-				has_adj[j] = true;
-				adj[i][j] = true;
-				adj[j][i] = true;
-			}
+		for( k=graph->adj_start[i]; k<graph->adj_start[i+1]; k++ ) {
+			if( graph->adj[k] > i )
+				addEdge(edgeList, adj, words, has_adj, i, graph->adj[k]);
 		}
 
 		if( ! has_adj[i] ) {
+			int j;
 #			ifdef TWOPO_DEBUG
 			fprintf(stderr, "TwoPO DEBUG: createEdgeSpace(): "
 					"creating cross-products.\n");
 #			endif
 			for( j=0; j<numNodes; j++ ) {
-				Edge edge;
-				if( i == j )
-					continue;
-				edge.node[0] = i;
-				edge.node[1] = j;
-				listAdd(edgeList, &edge);
-				has_adj[i] = true;
-				has_adj[j] = true;
-				adj[i][j] = true;
-				adj[j][i] = true;
+				if( i != j )
+					addEdge(edgeList, adj, words, has_adj, i, j);
 			}
 		}
 	}
+	connectComponents(edgeList, adj, words, has_adj, numNodes);
 
 	pfree(has_adj);
+	if( essentials->rowsOnly )
+		createSelectivities(essentials, graph);
+	else
+		ljqo_graph_destroy(graph);
 
 #	if ENABLE_OPTE
 	opte_printf("Number of Edges: %lu", listSize(edgeList));
@@ -1256,7 +2553,8 @@ createEdges(twopoEssentials *essentials)
 
 	essentials->numEdges = listSize(edgeList);
 	essentials->edgeList = (Edge*)listDestroyControlOnly(edgeList);
-	essentials->adj      = adj;
+	essentials->adj       = adj;
+	essentials->maskWords = words;
 }
 
 static treeNode*
@@ -1276,6 +2574,23 @@ buildNodeList( List *initial_rels, int levels_needed )
 	return nodeList;
 }
 
+/**
+ * rowsOnlyApplies:
+ *    Rows-only evaluation assumes that any two disjoint sets of relations
+ *    can be joined, so it is used only for queries with inner joins.
+ */
+static bool
+rowsOnlyApplies( PlannerInfo *root )
+{
+	if( !twopo_rows_only || root->join_info_list != NIL )
+		return false;
+#	if PG_VERSION_NUM >= 90300
+	if( root->hasLateralRTEs )
+		return false;
+#	endif
+	return true;
+}
+
 static twopoEssentials *
 createEssentials( PlannerInfo *root, int levels_needed, List *initial_rels)
 {
@@ -1284,12 +2599,14 @@ createEssentials( PlannerInfo *root, int levels_needed, List *initial_rels)
 	essentials = (twopoEssentials *) palloc0( sizeof(twopoEssentials) );
 
 	OPTE_GET_BY_PLANNERINFO( essentials->opte, root );
+	ljqo_random_init( &essentials->random );
 	/*
 	 * Construção da lista de relações base (vértices) da consulta.
 	 */
 	essentials->root = root;
 	essentials->numNodes = levels_needed;
 	essentials->nodeList  = buildNodeList(initial_rels,levels_needed);
+	essentials->rowsOnly  = rowsOnlyApplies(root);
 
 	/*
 	 * Construção da lista de arestas que ligam as relações base.
@@ -1297,6 +2614,17 @@ createEssentials( PlannerInfo *root, int levels_needed, List *initial_rels)
 	 */
 	createEdges( essentials );
 
+	createStateMemo( essentials );
+
+	if( essentials->rowsOnly ) {
+		essentials->scratchMasks = (uint64*)
+				palloc(sizeof(uint64) * essentials->maskWords * 2);
+		essentials->finalists = (State**)
+				palloc(sizeof(State*) * twopo_finalists);
+		essentials->finalistPrints = (uint64*)
+				palloc(sizeof(uint64) * twopo_finalists);
+	}
+
 	return essentials;
 }
 
@@ -1315,50 +2643,236 @@ destroyEssentials( twopoEssentials *essentials )
 	if( essentials->edgeList )
 		pfree(essentials->edgeList);
 
-	if( essentials->adj ) {
-		int i;
-		for( i=0; i<essentials->numNodes; i++ ){
-			if( essentials->adj[i] )
-				pfree( essentials->adj[i] );
-		}
+	if( essentials->adj )
 		pfree( essentials->adj );
+
+	if( essentials->stateMemo )
+		pfree( essentials->stateMemo );
+
+	if( essentials->rowsOnly ) {
+		int i;
+
+		for( i=0; i<essentials->numFinalists; i++ )
+			destroyState( essentials->finalists[i] );
+		pfree( essentials->finalists );
+		pfree( essentials->finalistPrints );
+		pfree( essentials->scratchMasks );
+		pfree( essentials->selValue );
+		pfree( essentials->ecFirst );
+		pfree( essentials->ecCount );
+		pfree( essentials->ecSeen );
+		if( essentials->ecItems )
+			pfree( essentials->ecItems );
+		ljqo_graph_destroy( essentials->graph );
 	}
 
 	pfree(essentials);
 }
 
 //////////////////////////////////////////////////////////////////////////////
-////////////////////////// Optimization Functions ////////////////////////////
+///////////////////// Refinement across re-plans /////////////////////////////
+
+/**
+ * refineApplies:
+ *    The search is continued by the SA phase, so refinement needs it.
+ */
+static inline bool
+refineApplies(void)
+{
+	return twopo_refine_size > 0 && twopo_sa_phase;
+}
+
+/**
+ * refineLookup:
+ *    Entry of "problem" whose state fits the current search space, or
+ *    NULL.
+ */
+static refineEntry *
+refineLookup( ljqo_join_problem *problem, StateType type, int size )
+{
+	refineEntry *entry;
+
+	if( !refineTable )
+		return NULL;
+
+	entry = (refineEntry*) hash_search(refineTable,
+			&problem->shape_fingerprint, HASH_FIND, NULL);
+	if( !entry
+			|| entry->nwords != problem->nshape_words
+			|| memcmp(entry->words, problem->words,
+					sizeof(uint32) * problem->nshape_words) != 0
+			|| entry->type != type || entry->size != size )
+		return NULL;
 
+	entry->lastUsed = ++refineClock;
+
+	return entry;
+}
+
+/**
+ * refineEvict:
+ *    Removes the least recently used entry. Only called after a search, so
+ *    a linear scan is cheap enough.
+ */
+static void
+refineEvict(void)
+{
+	HASH_SEQ_STATUS  status;
+	refineEntry     *entry;
+	refineEntry     *victim = NULL;
+
+	hash_seq_init(&status, refineTable);
+	while( (entry = (refineEntry*) hash_seq_search(&status)) != NULL ) {
+		if( !victim || entry->lastUsed < victim->lastUsed )
+			victim = entry;
+	}
+
+	if( victim ) {
+		pfree( victim->words );
+		pfree( victim->elementList );
+		hash_search(refineTable, &victim->fingerprint, HASH_REMOVE, NULL);
+	}
+}
+
+/**
+ * refineStore:
+ *    Keeps "state", the best state of the search of "problem", and the
+ *    point reached by the SA phase ("temperature" relative to the cost of
+ *    "state"), so that the next plan continues from there. "resumed" is
+ *    the entry the search started from, if any.
+ */
+static void
+refineStore( ljqo_join_problem *problem, refineEntry *resumed, State *state,
+		double temperature, int stageCount )
+{
+	refineEntry *entry = resumed;
+	bool         found;
+
+	if( !refineTable ) {
+		HASHCTL hashCtl;
+
+		refineContext = AllocSetContextCreate(TopMemoryContext,
+				"TwoPO Refinement",
+				ALLOCSET_DEFAULT_MINSIZE,
+				ALLOCSET_DEFAULT_INITSIZE,
+				ALLOCSET_DEFAULT_MAXSIZE);
+		memset(&hashCtl, 0, sizeof(hashCtl));
+		hashCtl.keysize   = sizeof(uint64);
+		hashCtl.entrysize = sizeof(refineEntry);
+		hashCtl.hash      = tag_hash;
+		hashCtl.hcxt      = refineContext;
+		refineTable = hash_create("TwoPO refinement", 64, &hashCtl,
+				HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+	}
+
+	if( entry ) {
+		entry->runs++;
+	} else {
+		entry = (refineEntry*) hash_search(refineTable,
+				&problem->shape_fingerprint, HASH_FIND, NULL);
+		if( entry ) {
+			// other problem with the same fingerprint, or other search space
+			pfree( entry->words );
+			pfree( entry->elementList );
+		} else {
+			// twopo_refine_size may have been reduced
+			while( hash_get_num_entries(refineTable) >= twopo_refine_size )
+				refineEvict();
+			entry = (refineEntry*) hash_search(refineTable,
+					&problem->shape_fingerprint, HASH_ENTER, &found);
+		}
+		entry->runs = 0;
+		entry->nwords = problem->nshape_words;
+		entry->words = (uint32*) MemoryContextAlloc(refineContext,
+				sizeof(uint32) * problem->nshape_words);
+		memcpy(entry->words, problem->words,
+				sizeof(uint32) * problem->nshape_words);
+		entry->type = state->type;
+		entry->size = state->size;
+		entry->elementList = (Element*) MemoryContextAlloc(refineContext,
+				sizeof(Element) * state->size);
+	}
+
+	Assert( entry->type == state->type && entry->size == state->size );
+
+	memcpy(entry->elementList, state->elementList,
+			sizeof(Element) * state->size);
+	entry->temperature = temperature;
+	entry->stageCount = stageCount;
+	entry->lastUsed = ++refineClock;
+}
+
+/**
+ * resumeState:
+ *    Rebuilds the best state of "entry" for the current plan. The SA phase
+ *    starts from it, at the temperature it had reached (scaled to the new
+ *    cost of the state), instead of a new II phase.
+ */
 static State *
-iiImprove(State *output, State *input)
+resumeState( twopoEssentials *essentials, refineEntry *entry,
+		double *temperature, int *stageCount )
 {
-	State       *new_state = NULL;
-	Cost         new_cost;
+	State *state = createState( essentials, (StateType) entry->type );
+
+	Assert( state->size == entry->size );
+
+	memcpy(state->elementList, entry->elementList,
+			sizeof(Element) * state->size);
+	resetStateNodes(state);
+	if( state->type == stBushy )
+		buildRelMasks(state, state->size -1);
+	evaluateState( state, NO_COST_BOUND );
+
+	*temperature = entry->temperature * (double) state->cost;
+	*stageCount  = entry->stageCount;
+
+#	ifdef TWOPO_DEBUG
+	fprintf(stderr, "TwoPO DEBUG: resumed search, runs=%d, cost=%.2lf, "
+			"temp=%.2lf\n", entry->runs, state->cost, *temperature);
+#	endif
+
+	return state;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+////////////////////////// Optimization Functions ////////////////////////////
+
+/**
+ * iiImprove:
+ *    Moves "state" to a local minimum. Each move is applied in place and
+ *    reverted if it does not reduce the cost.
+ */
+static void
+iiImprove(State *state)
+{
+	Move        *move;
 	Cost         cheapest_cost;
 	int          i;
 	int          local_minimum;
 
-	output = copyState(output, input);
-	cheapest_cost = output->cost;
+	move = createMove(state->essentials);
+	cheapest_cost = state->cost;
+#	ifdef TWOPO_CACHE_PLANS
+	setLiveStates(state->essentials, state,
+			state->essentials->bestState);
+#	endif
 
 	i = 0;
-	local_minimum = input->size;
-	while( i < local_minimum ){
-		new_state = neighbordState(new_state, output);
-		new_cost = new_state->cost;
-		if( new_cost < cheapest_cost ){
-			output = copyState(output, new_state);
-			cheapest_cost = new_cost;
+	local_minimum = state->size;
+	while( i < local_minimum && !ljqo_time_budget_poll() ){
+		neighbordState(state, move,
+				twopo_ii_cutoff ? cheapest_cost : NO_COST_BOUND);
+		if( move->applied && state->cost != COST_REJECTED
+				&& state->cost < cheapest_cost ){
+			cheapest_cost = state->cost;
 			i=0;
 		} else {
+			undoMove(state, move);
 			i++;
 		}
 	}
 
-	destroyState(new_state);
-
-	return output;
+	destroyMove(move);
 }
 
 static State *
@@ -1366,59 +2880,67 @@ iiPhase( twopoEssentials *essentials )
 {
 	int     i;
 	State  *min_state      = NULL;
-	State  *new_state      = NULL;
 	State  *improved_state = NULL;
 	Cost    min_cost       = COST_UNGENERATED;
 
 	Assert( essentials != NULL );
 
 	for( i=0; i<twopo_ii_stop; i++ ){
-		if( twopo_ii_improve_states ) {
-			new_state      = makeInitialState(new_state, essentials, i);
-			improved_state = iiImprove(improved_state, new_state);
-		} else {
-			improved_state = makeInitialState(improved_state, essentials, i);
-		}
+		// the first state is always generated
+		if( i && ljqo_time_budget_exhausted() )
+			break;
+		improved_state = makeInitialState(improved_state, essentials, i);
+		if( twopo_ii_improve_states )
+			iiImprove(improved_state);
 		if( !i || min_cost > improved_state->cost ) {
 			swapValues( State*, improved_state, min_state );
 			min_cost = min_state->cost;
+#			ifdef TWOPO_CACHE_PLANS
+			setLiveStates(essentials, NULL, min_state);
+#			endif
 		}
 	}
 
-	destroyState(new_state);
+#	ifdef TWOPO_CACHE_PLANS
+	setLiveStates(essentials, NULL, NULL);
+#	endif
 	destroyState(improved_state);
 
 	return min_state;
 }
 
 inline static bool
-saProbability( Cost delta, double temperature )
+saProbability( Cost delta, double temperature, ljqo_random_state *rnd )
 {
 	double e = exp( - delta / temperature );
-	int    r = random() % 100;
+	double r = ljqo_random_double( rnd );
 #	ifndef TWOPO_DEBUG
-	return r <= ((int)(100.0*e));
+	return r < e;
 #	else
-	if ( r <= ((int)(100.0*e)) ) {
+	if ( r < e ) {
 		fprintf(stderr, "TwoPO DEBUG: sa_prob_ok, "
-				"temp=%02.2lf, delta=%02.2lf, r=%2d, e=%2d\n",
-				temperature, delta, r, (int)(100.0*e));
+				"temp=%02.2lf, delta=%02.2lf, r=%.4lf, e=%.4lf\n",
+				temperature, delta, r, e);
 		return true;
 	}
 	return false;
 #	endif
 }
 
+/**
+ * saPhase:
+ *    Simulated annealing from "initial_state". "temperature" and
+ *    "stageCount" hold where the annealing starts (temperature 0 starts a
+ *    new one) and return where it stopped, so that it can be continued.
+ */
 static State *
-saPhase( State *initial_state )
+saPhase( State *initial_state, double *temperature, int *stageCount )
 {
 	int     i;
-	double  temperature;
 	int     equilibrium;
-	int     stage_count           = 0;
 	State  *min_state             = NULL;
 	State  *improved_state        = NULL;
-	State  *new_state             = NULL;
+	Move   *move;
 	Cost    min_cost;
 	Cost    improved_cost;
 	Cost    new_cost              = COST_UNGENERATED;
@@ -1431,44 +2953,63 @@ saPhase( State *initial_state )
 	improved_state = copyState(improved_state, initial_state);
 	min_cost       =
     improved_cost  = initial_state->cost;
-	temperature    = twopo_sa_initial_temperature * (double) min_cost;
+	if( *temperature <= 0 )
+		*temperature = twopo_sa_initial_temperature * (double) min_cost;
 	equilibrium    = twopo_sa_equilibrium * initial_state->size;
+	move           = createMove(initial_state->essentials);
+#	ifdef TWOPO_CACHE_PLANS
+	setLiveStates(initial_state->essentials, improved_state, min_state);
+#	endif
 
 #	ifdef TWOPO_DEBUG
 	fprintf(stderr, "TwoPO DEBUG: SA phase, min_cost=%.2lf\n", min_cost);
 #	endif
 
-	while( temperature >= 1 && stage_count < 5 ){ // frozen condition
+	while( *temperature >= 1 && *stageCount < 5 ){ // frozen condition
 
 		for( i=0; i<equilibrium; i++ ){
-			new_state = neighbordState(new_state, improved_state);
-			new_cost = new_state->cost;
+			if( ljqo_time_budget_poll() )
+				break;
+			neighbordState(improved_state, move, NO_COST_BOUND);
+			new_cost = improved_state->cost;
 			delta_cost = new_cost - improved_cost;
 
-			if( delta_cost <= 0 || saProbability(delta_cost,temperature) ){
+			if( delta_cost <= 0 || saProbability(delta_cost, *temperature,
+						&initial_state->essentials->random) ){
 
-				swapValues(State*,new_state,improved_state);
 				improved_cost = new_cost;
 
 				if( improved_cost < min_cost ){
 					min_state   = copyState(min_state, improved_state);
 					min_cost    = improved_cost;
-					stage_count = 0;
+					*stageCount = 0;
 
 #					ifdef TWOPO_DEBUG
 					fprintf(stderr, "TwoPO DEBUG: sa_new_min_cost:%.2lf\n",
 							min_cost);
 #					endif
 				}
+			} else {
+				undoMove(improved_state, move);
 			}
 		}
 
-		stage_count++;
-		temperature *= twopo_sa_temperature_reduction; //reducing temperature
+		if( i < equilibrium ) { // time budget exhausted
+#			ifdef TWOPO_DEBUG
+			fprintf(stderr, "TwoPO DEBUG: SA phase stopped by time budget\n");
+#			endif
+			break;
+		}
+
+		(*stageCount)++;
+		*temperature *= twopo_sa_temperature_reduction; //reducing temperature
 	}
 
+#	ifdef TWOPO_CACHE_PLANS
+	setLiveStates(initial_state->essentials, NULL, NULL);
+#	endif
 	destroyState( improved_state );
-	destroyState( new_state );
+	destroyMove( move );
 
 	return min_state;
 }
@@ -1479,6 +3020,10 @@ twopo(PlannerInfo *root, int levels_needed, List *initial_rels)
 	twopoEssentials  *essentials;
 	State            *min_state   = NULL;
 	treeNode         *node;
+	ljqo_join_problem *problem    = NULL;
+	refineEntry      *refine      = NULL;
+	double            temperature = 0;  // 0: new SA phase
+	int               stageCount  = 0;
 
 	Assert( levels_needed > 1 );
 	Assert( root != NULL );
@@ -1496,6 +3041,15 @@ twopo(PlannerInfo *root, int levels_needed, List *initial_rels)
 		return result;
 	}
 
+	// search of a previous plan of the same problem
+	if( refineApplies() ) {
+		problem = ljqo_join_problem_create(root, initial_rels,
+				levels_needed);
+		refine = refineLookup(problem,
+				twopo_bushy_space ? stBushy : stLeftDeep,
+				twopo_bushy_space ? levels_needed -1 : levels_needed);
+	}
+
 	///////////////// Temporary memory context area ////////////////////////
 #	ifdef TWOPO_DEBUG
 	fprintf(stderr, "TwoPO DEBUG: inicio do contexto de memoria temporario\n");
@@ -1503,15 +3057,30 @@ twopo(PlannerInfo *root, int levels_needed, List *initial_rels)
 	createTemporaryContext( essentials );
 
 	////////////// II phase //////////////
-	min_state = iiPhase( essentials );
+	if( refine )
+		min_state = resumeState( essentials, refine, &temperature,
+				&stageCount );
+	else
+		min_state = iiPhase( essentials );
 
 	////////////// SA phase //////////////
-	if( twopo_sa_phase ) {
+	if( twopo_sa_phase && !ljqo_time_budget_exhausted() ) {
 		State *S0 = min_state;
-		min_state = saPhase( S0 );
+		min_state = saPhase( S0, &temperature, &stageCount );
 		destroyState( S0 );
 	}
 
+	// relative to the cost of the best state: the cost of a new plan of the
+	// problem differs, and so does the cost of a finalist
+	temperature = min_state->cost > 0 ? temperature / min_state->cost : 0;
+
+	////////////// finalists //////////////
+	if( essentials->rowsOnly )
+		planFinalists( min_state );
+
+	if( problem )
+		refineStore( problem, refine, min_state, temperature, stageCount );
+
 	restoreOldContext( essentials );
 	//////////////// end of temporary memory context area //////////////////
 #	ifdef TWOPO_DEBUG
@@ -1521,10 +3090,21 @@ twopo(PlannerInfo *root, int levels_needed, List *initial_rels)
 #	if ENABLE_OPTE
 	opte_printf("Created Nodes: %d", essentials->opteCreatedNodes);
 	opte_printf("Reused Nodes: %d", essentials->opteReusedNodes);
+	opte_printf("Cache Evictions: %d", essentials->opteCacheEvictions);
+	opte_printf("Cutoff States: %d", essentials->opteCutoffStates);
+	if( essentials->rowsOnly )
+		opte_printf("Finalists: %d", essentials->numFinalists);
+	if( refine )
+		opte_printf("Refinement Runs: %d", refine->runs);
+	opte_printf("State Memo Hits: %d/%d (%.1lf%%)",
+			essentials->opteMemoHits, essentials->opteMemoLookups,
+			essentials->opteMemoLookups
+				? 100.0 * essentials->opteMemoHits / essentials->opteMemoLookups
+				: 0.0);
 #	endif
 
 	// rebuild best state in correct memory context
-	node = buildTree( min_state );
+	node = buildTree( min_state, NO_COST_BOUND );
 
 	Assert( node != NULL );
 	Assert( node->rel != NULL );
@@ -1536,6 +3116,7 @@ twopo(PlannerInfo *root, int levels_needed, List *initial_rels)
 
 	destroyState(min_state);
 	destroyEssentials(essentials);
+	ljqo_join_problem_destroy(problem);
 
 	return node->rel;
 }
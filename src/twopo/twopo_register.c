@@ -48,6 +48,10 @@ show_twopo_about(void)
 	"                                           default="R_STR(DEFAULT_TWOPO_II_STOP)"\n"
 	"  twopo_ii_improve_states = {true|false} - find local-minimum of each initial state\n"
 	"                                           default=true\n"
+	"  twopo_ii_cutoff = {true|false}         - stop building neighbors costlier than\n"
+	"                                           the local minimum in II phase\n"
+	"                                           (heuristic, may miss better plans)\n"
+	"                                           default=false\n"
 	"  twopo_sa_phase = {true|false}          - enables Simulated Annealing (SA) phase\n"
 	"                                           default=true\n"
 	"  twopo_sa_initial_temperature = Float   - initial temperature for SA phase\n"
@@ -57,6 +61,30 @@ show_twopo_about(void)
 	"  twopo_sa_equilibrium = Int             - number of states generated for each temperature\n"
 	"                                           (Int * State Size)\n"
 	"                                           default="R_STR(DEFAULT_TWOPO_SA_EQUILIBRIUM)"\n"
+	"  twopo_state_memo_size = Int            - number of visited states whose costs are\n"
+	"                                           remembered (0 disables it)\n"
+	"                                           default="R_STR(DEFAULT_TWOPO_STATE_MEMO_SIZE)"\n"
+	"  twopo_rows_only = {true|false}         - search with estimated join sizes and\n"
+	"                                           build paths only for the finalists\n"
+	"                                           (queries with inner joins only)\n"
+	"                                           default=false\n"
+	"  twopo_finalists = Int                  - number of states planned in full\n"
+	"                                           at the end of rows-only search\n"
+	"                                           default="R_STR(DEFAULT_TWOPO_FINALISTS)"\n"
+	"  twopo_refine_size = Int                - number of join problems whose search\n"
+	"                                           is continued by the next plan of the\n"
+	"                                           same problem, e.g. a prepared\n"
+	"                                           statement (0 disables it). Each plan\n"
+	"                                           searches for ljqo_time_budget_ms\n"
+	"                                           default="R_STR(DEFAULT_TWOPO_REFINE_SIZE)"\n"
+#	ifdef TWOPO_CACHE_PLANS
+	"  twopo_cache_plans = {true|false}       - reuse joins generated earlier\n"
+	"                                           default=true\n"
+	"  twopo_cache_size = Int                 - approximate limit of the join\n"
+	"                                           cache (KB), from an estimate of\n"
+	"                                           the size of each cached join\n"
+	"                                           default="R_STR(DEFAULT_TWOPO_CACHE_SIZE)"\n"
+#	endif
 	;
 }
 
@@ -117,6 +145,17 @@ twopo_register(void)
 			NULL,
 			NULL,
 			NULL);
+	DefineCustomBoolVariable("twopo_ii_cutoff",
+			"TwoPO II Cutoff",
+			"Stops the construction of plans in Iterative Improvement "
+			"phase when they exceed the cost of the local minimum.",
+			&twopo_ii_cutoff,
+			DEFAULT_TWOPO_II_CUTOFF,
+			PGC_USERSET,
+			0,
+			NULL,
+			NULL,
+			NULL);
 	DefineCustomBoolVariable("twopo_sa_phase",
 			"TwoPO SA Phase",
 			"Enables Simulated Annealing phase.",
@@ -163,6 +202,56 @@ twopo_register(void)
 			NULL,
 			NULL,
 			NULL);
+	DefineCustomIntVariable("twopo_state_memo_size",
+			"TwoPO State Memo Size",
+			"Number of visited states whose costs are remembered "
+			"(0 disables the memo).",
+			&twopo_state_memo_size,
+			DEFAULT_TWOPO_STATE_MEMO_SIZE,
+			MIN_TWOPO_STATE_MEMO_SIZE,
+			MAX_TWOPO_STATE_MEMO_SIZE,
+			PGC_USERSET,
+			0,
+			NULL,
+			NULL,
+			NULL);
+	DefineCustomBoolVariable("twopo_rows_only",
+			"TwoPO Rows-only Evaluation",
+			"Compares states by estimated join sizes and builds paths "
+			"only for the best ones (queries with inner joins only).",
+			&twopo_rows_only,
+			DEFAULT_TWOPO_ROWS_ONLY,
+			PGC_USERSET,
+			0,
+			NULL,
+			NULL,
+			NULL);
+	DefineCustomIntVariable("twopo_finalists",
+			"TwoPO Finalists",
+			"Number of states planned in full at the end of a "
+			"rows-only search.",
+			&twopo_finalists,
+			DEFAULT_TWOPO_FINALISTS,
+			MIN_TWOPO_FINALISTS,
+			MAX_TWOPO_FINALISTS,
+			PGC_USERSET,
+			0,
+			NULL,
+			NULL,
+			NULL);
+	DefineCustomIntVariable("twopo_refine_size",
+			"TwoPO Refinement Size",
+			"Number of join problems whose search is continued when "
+			"they are planned again (0 disables it).",
+			&twopo_refine_size,
+			DEFAULT_TWOPO_REFINE_SIZE,
+			MIN_TWOPO_REFINE_SIZE,
+			MAX_TWOPO_REFINE_SIZE,
+			PGC_USERSET,
+			0,
+			NULL,
+			NULL,
+			NULL);
 #	ifdef TWOPO_CACHE_PLANS
 	DefineCustomBoolVariable("twopo_cache_plans",
 			"TwoPO Cache Plans",
@@ -176,7 +265,8 @@ twopo_register(void)
 			NULL);
 	DefineCustomIntVariable("twopo_cache_size",
 			"TwoPO Cache Size",
-			"Limits the memory used to cache plans (in KB).",
+			"Approximate limit of the memory used to cache plans (in KB). "
+			"The size of each cached join is estimated, not measured.",
 			&twopo_cache_size,
 			DEFAULT_TWOPO_CACHE_SIZE,
 			MIN_TWOPO_CACHE_SIZE,